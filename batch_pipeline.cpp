@@ -0,0 +1,166 @@
+#include "batch_pipeline.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+
+// Writes text with one unbuffered write instead of formatting it line by line
+void writeFile(const std::string& path, const std::string& text) {
+    std::FILE* file = std::fopen(path.c_str(), "w");
+    if (!file) {
+        throw std::runtime_error("Failed to open output file for writing: " + path);
+    }
+    std::setvbuf(file, nullptr, _IONBF, 0);
+    size_t written = std::fwrite(text.data(), 1, text.size(), file);
+    if (std::fclose(file) != 0 || written != text.size()) {
+        throw std::runtime_error("Failed to write output file: " + path);
+    }
+}
+
+} // namespace
+
+BatchPipeline::BatchPipeline(const Compiler& prototype, Converter converter)
+    : prototype(prototype), converter(converter) {
+}
+
+int BatchPipeline::run(const std::string& inputFile, const std::string& outputDir, unsigned workers) {
+    std::vector<char> buffer(BUFFER_SIZE);
+    std::ifstream input;
+    input.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    input.open(inputFile);
+    if (!input) {
+        throw std::runtime_error("Could not open input file: " + inputFile);
+    }
+    std::filesystem::create_directories(outputDir);
+    workers = std::max(workers, 1u);
+    count = 0;
+    
+    BoundedQueue<BatchItem> lines(QUEUE_SIZE);
+    BoundedQueue<BatchItem> results(QUEUE_SIZE);
+    BoundedQueue<size_t> window(QUEUE_SIZE);
+    
+    std::thread reader([&] { read(input, outputDir, lines, window); });
+    
+    std::atomic<unsigned> running(workers);
+    std::vector<std::thread> compilers;
+    for (unsigned i = 0; i < workers; i++) {
+        compilers.emplace_back([&] {
+            compile(lines, results);
+            // The last worker to finish ends the writer's input
+            if (--running == 0) {
+                results.close();
+            }
+        });
+    }
+    
+    // The writer runs on this thread
+    int failures = write(results, window);
+    
+    reader.join();
+    for (std::thread& compiler : compilers) {
+        compiler.join();
+    }
+    return failures;
+}
+
+void BatchPipeline::read(std::istream& input, const std::string& outputDir, BoundedQueue<BatchItem>& lines,
+                         BoundedQueue<size_t>& window) {
+    std::string text;
+    int line = 0;
+    size_t index = 0;
+    while (std::getline(input, text)) {
+        line++;
+        size_t first = text.find_first_not_of(" \t\r");
+        if (first == std::string::npos || text[first] == '#') {
+            continue;
+        }
+        text.erase(text.find_last_not_of(" \t\r") + 1);
+        
+        BatchItem item;
+        item.index = index++;
+        item.line = line;
+        item.expression = text.substr(first);
+        item.file = (std::filesystem::path(outputDir) / ("line" + std::to_string(line) + ".asm")).string();
+        
+        // Waits while a slow line holds back QUEUE_SIZE others
+        window.push(item.index);
+        lines.push(std::move(item));
+    }
+    
+    count = index;
+    lines.close();
+}
+
+void BatchPipeline::compile(BoundedQueue<BatchItem>& lines, BoundedQueue<BatchItem>& results) {
+    // Compilers keep state such as the constant pool, so each worker has its own
+    Compiler compiler = prototype;
+    
+    BatchItem item;
+    while (lines.pop(item)) {
+        try {
+            std::string rpnExpression = converter(item.expression, compiler);
+            item.assembly = compiler.compileToString(rpnExpression, item.file, item.listing);
+        } catch (const std::exception& e) {
+            item.error = e.what();
+        }
+        
+        // Lines are independent: definitions only apply to their own line
+        if (item.expression.find(':') != std::string::npos) {
+            compiler.macros = prototype.macros;
+        }
+        results.push(std::move(item));
+    }
+}
+
+int BatchPipeline::write(BoundedQueue<BatchItem>& results, BoundedQueue<size_t>& window) {
+    // Workers finish out of order; lines are written and reported in input
+    // order. The window keeps pending to QUEUE_SIZE lines.
+    std::map<size_t, BatchItem> pending;
+    size_t next = 0;
+    int failures = 0;
+    std::string errors;
+    
+    BatchItem item;
+    while (results.pop(item)) {
+        pending[item.index] = std::move(item);
+        
+        for (auto ready = pending.find(next); ready != pending.end(); ready = pending.find(next)) {
+            BatchItem& done = ready->second;
+            if (done.error.empty()) {
+                try {
+                    writeFile(done.file, done.assembly);
+                    if (!done.listing.empty()) {
+                        writeFile(done.file + ".rpn", done.listing);
+                    }
+                } catch (const std::exception& e) {
+                    done.error = e.what();
+                }
+            }
+            
+            if (!done.error.empty()) {
+                failures++;
+                errors += "Error: Line " + std::to_string(done.line) + ": " + done.error + "\n";
+                if (errors.size() >= BUFFER_SIZE) {
+                    std::fwrite(errors.data(), 1, errors.size(), stderr);
+                    errors.clear();
+                }
+            }
+            
+            pending.erase(ready);
+            next++;
+            
+            // The reader took this ticket before the line, so it is there
+            size_t ticket;
+            window.pop(ticket);
+        }
+    }
+    
+    std::fwrite(errors.data(), 1, errors.size(), stderr);
+    return failures;
+}
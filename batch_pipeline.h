@@ -0,0 +1,112 @@
+#ifndef BATCH_PIPELINE_H
+#define BATCH_PIPELINE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <istream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "compiler.h"
+
+// Thread-safe FIFO with a fixed capacity. push() waits while the queue is
+// full and pop() while it is empty; after close(), pop() returns what is
+// left and then false.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+    
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+    }
+    
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+    
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+    }
+    
+private:
+    const size_t capacity;
+    std::deque<T> items;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+};
+
+// One line of a batch, numbered in input order
+struct BatchItem {
+    size_t index = 0;
+    int line = 0;
+    std::string expression;
+    std::string file;
+    // Filled in by a compile worker
+    std::string assembly;
+    std::string listing;
+    std::string error;
+};
+
+// Compiles every line of an input file to its own assembly file. A reader
+// thread, compile workers and a writer thread run at the same time over
+// bounded queues, so reading and writing overlap compilation. Each
+// expression is compiled once, and each file is written with a single
+// write of its whole text. The reader also takes a ticket from a window of
+// QUEUE_SIZE for each line, which the writer returns once the line is
+// written, so the lines the writer holds back to keep input order are
+// bounded too.
+class BatchPipeline {
+public:
+    // Turns a line into RPN for the compiler that will compile it, such as
+    // converting natural language
+    typedef std::function<std::string(const std::string&, const Compiler&)> Converter;
+    
+    // Every worker compiles with a copy of prototype, including its options
+    // and library definitions
+    BatchPipeline(const Compiler& prototype, Converter converter);
+    
+    // Writes line<N>.asm to outputDir for line N of inputFile, skipping
+    // blank lines and lines starting with #. Errors are reported per line
+    // on stderr; returns the number of lines that failed.
+    int run(const std::string& inputFile, const std::string& outputDir, unsigned workers);
+    
+    // Lines that can wait in each queue, and lines that can be read but not
+    // yet written
+    static const size_t QUEUE_SIZE = 256;
+    
+    // Size of the input buffer and of the buffered error output
+    static const size_t BUFFER_SIZE = 1 << 20;
+    
+    // Expressions compiled by the last run
+    size_t compiled() const { return count; }
+    
+private:
+    void read(std::istream& input, const std::string& outputDir, BoundedQueue<BatchItem>& lines,
+              BoundedQueue<size_t>& window);
+    void compile(BoundedQueue<BatchItem>& lines, BoundedQueue<BatchItem>& results);
+    int write(BoundedQueue<BatchItem>& results, BoundedQueue<size_t>& window);
+    
+    const Compiler& prototype;
+    Converter converter;
+    size_t count = 0;
+};
+
+#endif // BATCH_PIPELINE_H
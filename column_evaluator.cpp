@@ -0,0 +1,278 @@
+#include "column_evaluator.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// Unique within the directory while the process runs
+std::string temporaryPath(const std::string& path, unsigned long process) {
+    static std::atomic<unsigned> counter(0);
+    return path + ".tmp" + std::to_string(process) + "." + std::to_string(counter++);
+}
+
+} // namespace
+
+MappedColumn::MappedColumn() : address(nullptr), size(0) {
+#ifdef _WIN32
+    file = INVALID_HANDLE_VALUE;
+    mapping = nullptr;
+#else
+    fd = -1;
+#endif
+}
+
+MappedColumn::MappedColumn(MappedColumn&& other) : MappedColumn() {
+    *this = std::move(other);
+}
+
+MappedColumn& MappedColumn::operator=(MappedColumn&& other) {
+    if (this != &other) {
+        release();
+        address = other.address;
+        size = other.size;
+        path = std::move(other.path);
+        temporary = std::move(other.temporary);
+        other.temporary.clear();
+#ifdef _WIN32
+        file = other.file;
+        mapping = other.mapping;
+        other.file = INVALID_HANDLE_VALUE;
+        other.mapping = nullptr;
+#else
+        fd = other.fd;
+        other.fd = -1;
+#endif
+        other.address = nullptr;
+        other.size = 0;
+    }
+    return *this;
+}
+
+MappedColumn::~MappedColumn() {
+    release();
+}
+
+MappedColumn MappedColumn::openInput(const std::string& path) {
+    return map(path, 0, false);
+}
+
+MappedColumn MappedColumn::createOutput(const std::string& path, size_t rows) {
+    return map(path, rows * sizeof(double), true);
+}
+
+void MappedColumn::commit() {
+    unmap();
+#ifdef _WIN32
+    if (!MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+#else
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+#endif
+        throw std::runtime_error("Could not replace column file: " + path);
+    }
+    temporary.clear();
+}
+
+void MappedColumn::release() {
+    unmap();
+    if (!temporary.empty()) {
+        std::remove(temporary.c_str());
+        temporary.clear();
+    }
+}
+
+#ifdef _WIN32
+
+MappedColumn MappedColumn::map(const std::string& path, size_t bytes, bool writable) {
+    MappedColumn column;
+    std::string file = path;
+    if (writable) {
+        column.path = path;
+        column.temporary = file = temporaryPath(path, GetCurrentProcessId());
+    }
+    // Inputs share delete access so a committed output can replace them
+    column.file = CreateFileA(file.c_str(), writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+                              FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, writable ? CREATE_NEW : OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (column.file == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("Could not open column file: " + path);
+    }
+    
+    if (!writable) {
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(column.file, &fileSize)) {
+            throw std::runtime_error("Could not read size of column file: " + path);
+        }
+        bytes = static_cast<size_t>(fileSize.QuadPart);
+    }
+    if (bytes % sizeof(double) != 0) {
+        throw std::runtime_error("Column file is not a whole number of doubles: " + path);
+    }
+    column.size = bytes;
+    
+    // Empty files cannot be mapped, and there is nothing to read or write
+    if (bytes == 0) {
+        return column;
+    }
+    
+    // For output columns, creating the mapping extends the file to its size
+    uint64_t mappingSize = bytes;
+    column.mapping = CreateFileMappingA(column.file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY,
+                                        static_cast<DWORD>(mappingSize >> 32),
+                                        static_cast<DWORD>(mappingSize & 0xFFFFFFFF), nullptr);
+    if (!column.mapping) {
+        throw std::runtime_error("Could not map column file: " + path);
+    }
+    column.address = MapViewOfFile(column.mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, bytes);
+    if (!column.address) {
+        throw std::runtime_error("Could not map column file: " + path);
+    }
+    return column;
+}
+
+void MappedColumn::unmap() {
+    if (address) {
+        UnmapViewOfFile(address);
+        address = nullptr;
+    }
+    if (mapping) {
+        CloseHandle(mapping);
+        mapping = nullptr;
+    }
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+    }
+}
+
+#else
+
+MappedColumn MappedColumn::map(const std::string& path, size_t bytes, bool writable) {
+    MappedColumn column;
+    if (writable) {
+        column.path = path;
+        column.temporary = temporaryPath(path, static_cast<unsigned long>(getpid()));
+        column.fd = open(column.temporary.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    } else {
+        column.fd = open(path.c_str(), O_RDONLY);
+    }
+    if (column.fd < 0) {
+        throw std::runtime_error("Could not open column file: " + path);
+    }
+    
+    if (writable) {
+        if (ftruncate(column.fd, static_cast<off_t>(bytes)) != 0) {
+            throw std::runtime_error("Could not resize column file: " + path);
+        }
+    } else {
+        struct stat info;
+        if (fstat(column.fd, &info) != 0) {
+            throw std::runtime_error("Could not read size of column file: " + path);
+        }
+        bytes = static_cast<size_t>(info.st_size);
+    }
+    if (bytes % sizeof(double) != 0) {
+        throw std::runtime_error("Column file is not a whole number of doubles: " + path);
+    }
+    column.size = bytes;
+    
+    // Empty files cannot be mapped, and there is nothing to read or write
+    if (bytes == 0) {
+        return column;
+    }
+    
+    void* address = mmap(nullptr, bytes, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                         writable ? MAP_SHARED : MAP_PRIVATE, column.fd, 0);
+    if (address == MAP_FAILED) {
+        throw std::runtime_error("Could not map column file: " + path);
+    }
+    column.address = address;
+    
+    // Every column is read front to back
+    madvise(address, bytes, MADV_SEQUENTIAL);
+    return column;
+}
+
+void MappedColumn::unmap() {
+    if (address) {
+        munmap(address, size);
+        address = nullptr;
+    }
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+#endif
+
+ColumnEvaluator::ColumnEvaluator(const Interpreter& interpreter) : interpreter(interpreter) {
+}
+
+void ColumnEvaluator::run(const Bytecode& program, const std::vector<const double*>& inputs,
+                          const std::vector<double*>& outputs, size_t rows, unsigned threads) const {
+    size_t chunks = (rows + CHUNK_ROWS - 1) / CHUNK_ROWS;
+    threads = static_cast<unsigned>(std::min<size_t>(std::max(threads, 1u), std::max<size_t>(chunks, 1)));
+    
+    std::atomic<size_t> nextChunk(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    
+    auto worker = [&]() {
+        // Temporaries hold values for the current row, so every worker has its own
+        std::vector<double> temps(program.temps);
+        ExecutionContext context;
+        context.columns = inputs.data();
+        context.outputs = outputs.data();
+        context.temps = temps.data();
+        size_t row = 0;
+        try {
+            while (!failed) {
+                size_t chunk = nextChunk++;
+                if (chunk >= chunks) {
+                    break;
+                }
+                size_t end = std::min(rows, (chunk + 1) * CHUNK_ROWS);
+                for (row = chunk * CHUNK_ROWS; row < end; row++) {
+                    context.row = row;
+                    interpreter.execute(program, context);
+                }
+            }
+        } catch (const std::exception& e) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!failed.exchange(true)) {
+                error = std::make_exception_ptr(
+                    std::runtime_error("Row " + std::to_string(row) + ": " + e.what()));
+            }
+        }
+    };
+    
+    // The calling thread works too
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++) {
+        pool.push_back(std::thread(worker));
+    }
+    worker();
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+    
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
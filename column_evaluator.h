@@ -0,0 +1,71 @@
+#ifndef COLUMN_EVALUATOR_H
+#define COLUMN_EVALUATOR_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "interpreter.h"
+
+// A column file of raw little-endian doubles, memory-mapped.
+// Input columns are mapped read-only; output columns are created at their
+// final size and written through the mapping. An output is written to a
+// temporary file next to its path, so it may replace one of the inputs, and
+// a failed run leaves the existing file untouched.
+class MappedColumn {
+public:
+    static MappedColumn openInput(const std::string& path);
+    static MappedColumn createOutput(const std::string& path, size_t rows);
+    
+    // Unmaps an output column and renames it over its path. Without this,
+    // the temporary file is removed with the column.
+    void commit();
+    
+    MappedColumn(MappedColumn&& other);
+    MappedColumn& operator=(MappedColumn&& other);
+    MappedColumn(const MappedColumn&) = delete;
+    MappedColumn& operator=(const MappedColumn&) = delete;
+    ~MappedColumn();
+    
+    const double* data() const { return static_cast<const double*>(address); }
+    double* data() { return static_cast<double*>(address); }
+    size_t rows() const { return size / sizeof(double); }
+    
+private:
+    MappedColumn();
+    static MappedColumn map(const std::string& path, size_t bytes, bool writable);
+    void unmap();
+    void release();
+    
+    void* address;
+    size_t size;
+    // For output columns, the final path and the file being written
+    std::string path;
+    std::string temporary;
+#ifdef _WIN32
+    void* file;
+    void* mapping;
+#else
+    int fd;
+#endif
+};
+
+// Runs a kernel built by KernelFuser for every row of its input columns,
+// splitting the rows into chunks shared between worker threads
+class ColumnEvaluator {
+public:
+    explicit ColumnEvaluator(const Interpreter& interpreter);
+    
+    // inputs is indexed like Compiler::variables and outputs like the
+    // kernel's OUTPUT instructions. Errors such as division by zero stop the
+    // evaluation and are rethrown with the failing row.
+    void run(const Bytecode& program, const std::vector<const double*>& inputs,
+             const std::vector<double*>& outputs, size_t rows, unsigned threads) const;
+    
+    // Rows handed to a worker at a time
+    static const size_t CHUNK_ROWS = 16384;
+    
+private:
+    const Interpreter& interpreter;
+};
+
+#endif // COLUMN_EVALUATOR_H
@@ -1,13 +1,22 @@
 #include "compiler.h"
+#include "reassociation.h"
+#include "simplifier.h"
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <algorithm>
 #include <cctype>
 #include <cmath>
-#include <iomanip>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
 #include <regex>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
 // Define math constants if not available
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -18,122 +27,327 @@
 #endif
 
 Compiler::Compiler() {
-    // Initialize operator arities (number of operands)
-    operatorArities["+"] = 2;
-    operatorArities["-"] = 2;
-    operatorArities["*"] = 2;
-    operatorArities["/"] = 2;
-    operatorArities["^"] = 2;
-    operatorArities["%"] = 2;
-    operatorArities["!"] = 1;
-    operatorArities["abs"] = 1;
-    operatorArities["sin"] = 1;
-    operatorArities["cos"] = 1;
-    operatorArities["tan"] = 1;
-    operatorArities["sqrt"] = 1;
-    operatorArities["swap"] = 2;
-    operatorArities["dup"] = 1;
+    // Initialize the operator table (arity is the number of operands)
+    defineOperator("+", Token::OPERATOR, OP_ADD, 2);
+    defineOperator("-", Token::OPERATOR, OP_SUB, 2);
+    defineOperator("*", Token::OPERATOR, OP_MUL, 2);
+    defineOperator("/", Token::OPERATOR, OP_DIV, 2);
+    defineOperator("^", Token::OPERATOR, OP_POW, 2);
+    defineOperator("%", Token::OPERATOR, OP_MOD, 2);
+    defineOperator("!", Token::OPERATOR, OP_FACT, 1);
+    defineOperator("abs", Token::FUNCTION, OP_ABS, 1);
+    defineOperator("sin", Token::FUNCTION, OP_SIN, 1);
+    defineOperator("cos", Token::FUNCTION, OP_COS, 1);
+    defineOperator("tan", Token::FUNCTION, OP_TAN, 1);
+    defineOperator("sqrt", Token::FUNCTION, OP_SQRT, 1);
+    defineOperator("ln", Token::FUNCTION, OP_LN, 1);
+    defineOperator("<", Token::OPERATOR, OP_LT, 2);
+    defineOperator(">", Token::OPERATOR, OP_GT, 2);
+    defineOperator("min", Token::FUNCTION, OP_MIN, 2);
+    defineOperator("max", Token::FUNCTION, OP_MAX, 2);
+    defineOperator("select", Token::FUNCTION, OP_SELECT, 3);
+    defineOperator("swap", Token::STACK_OP, OP_SWAP, 2);
+    defineOperator("dup", Token::STACK_OP, OP_DUP, 1);
     
     // Initialize constants
     constants["pi"] = M_PI;
     constants["e"] = M_E;
 }
 
-void Compiler::compile(const std::string& expression, const std::string& outputFile) {
-    std::vector<Token> tokens = tokenize(expression);
+std::string Compiler::compile(const std::string& expression, const std::string& outputFile) {
+    return compile(tokenize(expression), expression, outputFile);
+}
+
+std::string Compiler::compile(const std::vector<Token>& tokens, const std::string& expression,
+                              const std::string& outputFile) {
+    std::string listing;
+    std::string assembly = compileToString(tokens, expression, outputFile, listing);
     
     std::ofstream outFile(outputFile);
     if (!outFile) {
         throw std::runtime_error("Failed to open output file for writing");
     }
+    outFile << assembly;
     
-    generateAssembly(tokens, outFile);
+    if (options.debugLines) {
+        std::ofstream listingFile(outputFile + ".rpn");
+        if (!listingFile) {
+            throw std::runtime_error("Failed to open listing file for writing");
+        }
+        listingFile << listing;
+    }
+    return assembly;
+}
+
+std::string Compiler::compileToString(const std::string& expression, const std::string& outputFile,
+                                      std::string& listing) {
+    return compileToString(tokenize(expression), expression, outputFile, listing);
+}
+
+std::string Compiler::compileToString(const std::vector<Token>& tokenized, const std::string& expression,
+                                      const std::string& outputFile, std::string& listing) {
+    std::vector<Token> tokens = optimize(tokenized);
+    
+    // The listing sits next to the assembly, which refers to it by name
+    std::string listingFile = outputFile + ".rpn";
+    size_t lastSlash = listingFile.find_last_of("/\\");
+    setSource(expression, lastSlash == std::string::npos ? listingFile : listingFile.substr(lastSlash + 1));
+    if (options.debugLines) {
+        std::ostringstream out;
+        writeListing(out);
+        listing = out.str();
+    }
+    
+    AssemblyBuffer out;
+    out.text.reserve(assemblySize(tokens));
+    generateAssembly(tokens, out);
+    return std::move(out.text);
 }
 
 std::string Compiler::compileToString(const std::string& expression) {
-    std::vector<Token> tokens = tokenize(expression);
-    std::ostringstream oss;
+    std::vector<Token> tokens = optimize(tokenize(expression));
+    AssemblyBuffer out;
+    out.text.reserve(assemblySize(tokens));
     
-    generateAssembly(tokens, oss);
+    setSource(expression, "expression.rpn");
     
-    return oss.str();
+    generateAssembly(tokens, out);
+    
+    return std::move(out.text);
+}
+
+size_t Compiler::assemblySize(const std::vector<Token>& tokens) const {
+    // Runtime helpers and data, then roughly what one word costs
+    return 4096 + 256 * tokens.size();
 }
 
 std::vector<Token> Compiler::tokenize(const std::string& expression) {
     std::vector<Token> tokens;
-    std::istringstream iss(expression);
-    std::string token;
-    
-    while (iss >> token) {
-        // Check if it's a number (including scientific notation)
-        bool isNumber = false;
-        size_t pos = 0;
-        try {
-            // stod supports scientific notation like 1.23e5
-            std::stod(token, &pos);
-            isNumber = (pos == token.size());
-            
-            // Also validate scientific notation format explicitly
-            if (!isNumber) {
-                std::regex scientificNotationRegex("^[-+]?[0-9]*\\.?[0-9]+([eE][-+]?[0-9]+)?$");
-                isNumber = std::regex_match(token, scientificNotationRegex);
+    std::vector<SourceWord> words = splitWords(expression);
+    
+    // Tokens go to the expression, or to the body of a ": name ... ;" definition
+    std::vector<Token> definition;
+    std::string definitionName;
+    std::vector<Token>* target = &tokens;
+    
+    for (size_t i = 0; i < words.size(); i++) {
+        const std::string& token = words[i].text;
+        int offset = static_cast<int>(words[i].offset);
+        
+        if (token == ":") {
+            if (target != &tokens) {
+                throw std::runtime_error("Nested definition in " + definitionName);
+            }
+            if (++i == words.size()) {
+                throw std::runtime_error("Definition without a name");
             }
-        } catch (...) {
-            isNumber = false;
+            definitionName = words[i].text;
+            definition.clear();
+            target = &definition;
+            continue;
+        }
+        if (token == ";") {
+            if (target == &tokens) {
+                throw std::runtime_error("; without a definition");
+            }
+            defineMacro(definitionName, definition);
+            target = &tokens;
+            continue;
         }
         
-        if (isNumber) {
-            tokens.push_back(Token(Token::NUMBER, token));
-        } 
-        // Check if it's a constant
-        else if (constants.find(token) != constants.end()) {
-            tokens.push_back(Token(Token::CONSTANT, token));
+        // Check if it's a number (including scientific notation);
+        // everything else is a single table lookup
+        auto op = operators.find(token);
+        if (isNumber(token)) {
+            target->push_back(Token(Token::NUMBER, token));
         }
-        // Check if it's a stack operation
-        else if (token == "swap" || token == "dup") {
-            tokens.push_back(Token(Token::STACK_OP, token));
+        else if (op != operators.end()) {
+            target->push_back(Token(op->second.type, token));
         }
-        // Check if it's a function
-        else if (token == "abs" || token == "sin" || token == "cos" || 
-                 token == "tan" || token == "sqrt") {
-            tokens.push_back(Token(Token::FUNCTION, token));
+        else if (constants.find(token) != constants.end()) {
+            target->push_back(Token(Token::CONSTANT, token));
+        }
+        // Check if it's an input variable
+        else if (variables.find(token) != variables.end()) {
+            target->push_back(Token(Token::VARIABLE, token));
         }
-        // Must be an operator
-        else if (token == "+" || token == "-" || token == "*" || token == "/" ||
-                 token == "^" || token == "%" || token == "!") {
-            tokens.push_back(Token(Token::OPERATOR, token));
+        // Inline user definitions
+        else if (macros.count(token)) {
+            // Inlined tokens belong to the word that used the definition
+            for (Token inlined : macros.at(token)) {
+                inlined.offset = offset;
+                target->push_back(inlined);
+            }
+            continue;
         }
         else {
             throw std::runtime_error("Unknown token: " + token);
         }
+        target->back().offset = offset;
     }
     
+    if (target != &tokens) {
+        throw std::runtime_error("Definition of " + definitionName + " is missing ;");
+    }
     return tokens;
 }
 
+std::vector<SourceWord> Compiler::splitWords(const std::string& expression) {
+    // Same separators as reading words with operator>>
+    const char* whitespace = " \t\n\v\f\r";
+    std::vector<SourceWord> words;
+    size_t start = expression.find_first_not_of(whitespace);
+    while (start != std::string::npos) {
+        size_t end = expression.find_first_of(whitespace, start);
+        SourceWord word;
+        word.offset = start;
+        word.text = expression.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        words.push_back(word);
+        start = end == std::string::npos ? end : expression.find_first_not_of(whitespace, end);
+    }
+    return words;
+}
+
+void Compiler::setSource(const std::string& expression, const std::string& listingName) {
+    sourceWords = splitWords(expression);
+    this->listingName = listingName;
+}
+
+void Compiler::writeListing(std::ostream& out) const {
+    for (const SourceWord& word : sourceWords) {
+        out << "offset " << word.offset << ": " << word.text << "\n";
+    }
+}
+
+bool Compiler::isNumber(const std::string& token) {
+    bool isNumber = false;
+    size_t pos = 0;
+    try {
+        // stod supports scientific notation like 1.23e5
+        std::stod(token, &pos);
+        isNumber = (pos == token.size());
+        
+        // Also validate scientific notation format explicitly
+        if (!isNumber) {
+            static const std::regex scientificNotationRegex("^[-+]?[0-9]*\\.?[0-9]+([eE][-+]?[0-9]+)?$");
+            isNumber = std::regex_match(token, scientificNotationRegex);
+        }
+    } catch (...) {
+        isNumber = false;
+    }
+    return isNumber;
+}
+
+Operation Compiler::operation(const Token& token) const {
+    if (token.type != Token::OPERATOR && token.type != Token::FUNCTION && token.type != Token::STACK_OP) {
+        return OPERATION_COUNT;
+    }
+    auto op = operators.find(token.strValue);
+    return op == operators.end() ? OPERATION_COUNT : op->second.operation;
+}
+
+void Compiler::defineOperator(const std::string& name, Token::Type type, Operation operation, int arity) {
+    OperatorInfo info;
+    info.type = type;
+    info.operation = operation;
+    info.arity = arity;
+    operators[name] = info;
+}
+
+void Compiler::defineMacro(const std::string& name, const std::vector<Token>& body) {
+    if (name == ":" || name == ";" || isNumber(name) || operators.count(name) ||
+        constants.count(name) || variables.count(name)) {
+        throw std::runtime_error("Cannot redefine " + name);
+    }
+    // Like Forth, a later definition replaces an earlier one for later uses
+    macros[name] = body;
+}
+
+void Compiler::loadLibrary(const std::string& path) {
+    std::ifstream inFile(path);
+    if (!inFile) {
+        throw std::runtime_error("Could not open library: " + path);
+    }
+    
+    std::string source;
+    std::string line;
+    while (std::getline(inFile, line)) {
+        // Lines starting with # are comments
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first != std::string::npos && line[first] != '#') {
+            source += line + " ";
+        }
+    }
+    
+    if (!tokenize(source).empty()) {
+        throw std::runtime_error("Library contains tokens outside a definition: " + path);
+    }
+}
+
+bool Compiler::isKnownWord(const std::string& word) const {
+    return operators.count(word) || constants.count(word) || variables.count(word) || macros.count(word);
+}
+
+std::vector<Token> Compiler::optimize(const std::vector<Token>& tokens) {
+    std::vector<Token> result = tokens;
+    rewrites.clear();
+    
+    // Simplify first so reassociation sees the smaller expression
+    if (options.simplify) {
+        Simplifier simplifier(*this);
+        result = simplifier.run(result);
+        rewrites = simplifier.fired();
+    }
+    
+    if (options.fastMath) {
+        Reassociator reassociator(*this);
+        result = reassociator.run(result);
+    }
+    
+    return result;
+}
+
 void Compiler::generateAssembly(const std::vector<Token>& tokens, std::ostream& out) {
+    AssemblyBuffer buffer;
+    buffer.text.reserve(assemblySize(tokens));
+    generateAssembly(tokens, buffer);
+    out.write(buffer.text.data(), static_cast<std::streamsize>(buffer.text.size()));
+}
+
+void Compiler::generateAssembly(const std::vector<Token>& tokens, AssemblyBuffer& out) {
     // Generate assembly header
     out << "; Math compiler output\n";
     out << "; Generated assembly for x86-64\n\n";
     
-    out << "section .data\n";
-    // Define constants used in the program
-    out << "    format db \"%lf\", 10, 0  ; Format for printf\n";
-    out << "    div_zero_msg db \"Error: Division by zero\", 10, 0\n";
-    out << "    stack_underflow_msg db \"Error: Stack underflow\", 10, 0\n";
+    if (options.errorMode != ERRORS_BRANCH) {
+        checkStackDepth(tokens);
+    }
+    if (options.precision == PRECISION_SINGLE && options.sharedRuntime) {
+        // The shared runtime's push_stack and pop_stack use 8-byte slots
+        throw std::runtime_error("-shared-runtime needs double or mixed precision");
+    }
+    emitPrecision = options.precision;
     
-    // Define used constants
-    for (auto& token : tokens) {
-        if (token.type == Token::CONSTANT) {
-            out << "    " << token.strValue << " dq " << std::fixed << std::setprecision(17) 
-                << constants[token.strValue] << "\n";
-        }
+    bool invalidResultCheck = options.errorMode == ERRORS_NAN_CHECKED;
+    if (!options.sharedRuntime) {
+        emitRuntimeData(out, invalidResultCheck);
     }
     
     out << "\nsection .text\n";
     out << "    global main\n";
     out << "    extern printf\n";
-    out << "    extern exit\n\n";
+    out << "    extern exit\n";
+    if (options.sharedRuntime) {
+        // Helpers and messages come from the runtime built by generateRuntime
+        out << "    extern push_stack\n";
+        out << "    extern pop_stack\n";
+        out << "    extern division_by_zero\n";
+        out << "    extern stack_underflow\n";
+        out << "    extern invalid_result\n";
+        out << "    extern format\n";
+        out << "    extern __m128d_abs_mask\n";
+    }
+    out << "\n";
     
     // Implement main function
     out << "main:\n";
@@ -147,318 +361,202 @@ void Compiler::generateAssembly(const std::vector<Token>& tokens, std::ostream&
     
     // Process each token
     int labelCounter = 0;
+    constantPool.clear();
+    constantOrder.clear();
     
-    for (size_t i = 0; i < tokens.size(); i++) {
-        const Token& token = tokens[i];
-        
-        out << "    ; Process token: " << token.strValue << "\n";
-        
-        switch (token.type) {
-            case Token::NUMBER: {
-                out << "    ; Push number onto stack\n";
-                out << "    movsd xmm0, __float64__(" << token.numValue << ")\n";
-                out << "    call push_stack\n";
-                break;
-            }
-            
-            case Token::CONSTANT: {
-                out << "    ; Push constant onto stack\n";
-                out << "    movsd xmm0, [rel " << token.strValue << "]\n";
-                out << "    call push_stack\n";
-                break;
-            }
-            
-            case Token::OPERATOR: {
-                int arity = operatorArities[token.strValue];
-                
-                out << "    ; Check if we have enough operands\n";
-                out << "    cmp r12, " << arity << "\n";
-                out << "    jl stack_underflow\n\n";
-                
-                if (token.strValue == "+") {
-                    out << "    ; Addition\n";
-                    out << "    call pop_stack  ; Get first operand into xmm0\n";
-                    out << "    movsd xmm1, xmm0\n";
-                    out << "    call pop_stack  ; Get second operand into xmm0\n";
-                    out << "    addsd xmm0, xmm1\n";
-                    out << "    call push_stack\n";
-                }
-                else if (token.strValue == "-") {
-                    out << "    ; Subtraction\n";
-                    out << "    call pop_stack  ; Get first operand into xmm0\n";
-                    out << "    movsd xmm1, xmm0\n";
-                    out << "    call pop_stack  ; Get second operand into xmm0\n";
-                    out << "    subsd xmm0, xmm1\n";
-                    out << "    call push_stack\n";
-                }
-                else if (token.strValue == "*") {
-                    out << "    ; Multiplication\n";
-                    out << "    call pop_stack  ; Get first operand into xmm0\n";
-                    out << "    movsd xmm1, xmm0\n";
-                    out << "    call pop_stack  ; Get second operand into xmm0\n";
-                    out << "    mulsd xmm0, xmm1\n";
-                    out << "    call push_stack\n";
-                }
-                else if (token.strValue == "/") {
-                    out << "    ; Division\n";
-                    out << "    call pop_stack  ; Get divisor into xmm0\n";
-                    out << "    ; Check if divisor is zero\n";
-                    out << "    xorpd xmm1, xmm1\n";
-                    out << "    ucomisd xmm0, xmm1\n";
-                    out << "    je division_by_zero\n";
-                    out << "    movsd xmm1, xmm0\n";
-                    out << "    call pop_stack  ; Get dividend into xmm0\n";
-                    out << "    divsd xmm0, xmm1\n";
-                    out << "    call push_stack\n";
-                }
-                else if (token.strValue == "^") {
-                    // We'll use the C library pow function
-                    labelCounter++;
-                    out << "    ; Power (x^y)\n";
-                    out << "    call pop_stack  ; Get exponent into xmm0\n";
-                    out << "    movsd xmm1, xmm0\n";
-                    out << "    call pop_stack  ; Get base into xmm0\n";
-                    
-                    // We use a simple approach for integer powers
-                    out << "    ; Check if exponent is an integer\n";
-                    out << "    cvttsd2si rax, xmm1  ; Convert to integer truncating\n";
-                    out << "    cvtsi2sd xmm2, rax   ; Convert back to double\n";
-                    out << "    ucomisd xmm1, xmm2   ; Compare original and converted value\n";
-                    out << "    jne power_general_" << labelCounter << "\n";
-                    
-                    // Integer power implementation
-                    out << "    ; Integer power implementation\n";
-                    out << "    movsd xmm2, __float64__(1.0)  ; Result accumulator\n";
-                    out << "    test rax, rax\n";
-                    out << "    jz power_done_" << labelCounter << "  ; x^0 = 1\n";
-                    out << "    js power_general_" << labelCounter << "  ; Negative exponent needs general case\n";
-                    
-                    out << "power_loop_" << labelCounter << ":\n";
-                    out << "    test rax, 1\n";
-                    out << "    jz power_skip_" << labelCounter << "\n";
-                    out << "    mulsd xmm2, xmm0  ; Multiply result by x\n";
-                    out << "power_skip_" << labelCounter << ":\n";
-                    out << "    mulsd xmm0, xmm0  ; Square x\n";
-                    out << "    shr rax, 1        ; Divide exponent by 2\n";
-                    out << "    jnz power_loop_" << labelCounter << "\n";
-                    out << "    movsd xmm0, xmm2\n";
-                    out << "    jmp power_done_" << labelCounter << "\n";
-                    
-                    // General power using exp and log
-                    out << "power_general_" << labelCounter << ":\n";
-                    out << "    ; x^y = exp(y * ln(x))\n";
-                    out << "    ; Check if x > 0 for log\n";
-                    out << "    xorpd xmm2, xmm2\n";
-                    out << "    ucomisd xmm0, xmm2\n";
-                    out << "    jbe power_error_" << labelCounter << "  ; If x <= 0, can't take log\n";
-                    
-                    out << "    sub rsp, 8  ; Align stack\n";
-                    out << "    movq [rsp], xmm0  ; Save x\n";
-                    out << "    movq [rsp-8], xmm1  ; Save y\n";
-                    
-                    out << "    call log  ; Get ln(x) in xmm0\n";
-                    out << "    movsd xmm1, [rsp-8]  ; Restore y to xmm1\n";
-                    out << "    mulsd xmm0, xmm1  ; y * ln(x)\n";
-                    out << "    call exp  ; exp(y * ln(x))\n";
-                    
-                    out << "    add rsp, 8  ; Restore stack\n";
-                    out << "    jmp power_done_" << labelCounter << "\n";
-                    
-                    out << "power_error_" << labelCounter << ":\n";
-                    out << "    ; Handle error case (probably not ideal but simple)\n";
-                    out << "    movsd xmm0, __float64__(0.0)\n";
-                    
-                    out << "power_done_" << labelCounter << ":\n";
-                    out << "    call push_stack\n";
-                }
-                else if (token.strValue == "%") {
-                    out << "    ; Modulus\n";
-                    out << "    call pop_stack  ; Get second operand into xmm0\n";
-                    out << "    ; Check if divisor is zero\n";
-                    out << "    xorpd xmm1, xmm1\n";
-                    out << "    ucomisd xmm0, xmm1\n";
-                    out << "    je division_by_zero\n";
-                    out << "    movsd xmm1, xmm0\n";
-                    out << "    call pop_stack  ; Get first operand into xmm0\n";
-                    
-                    // Implementation of floating-point modulus
-                    labelCounter++;
-                    out << "    ; Floating-point modulus: x % y = x - y * floor(x/y)\n";
-                    out << "    movsd xmm2, xmm0  ; Save x\n";
-                    out << "    divsd xmm0, xmm1  ; x / y\n";
-                    
-                    // Compute floor(x/y)
-                    out << "    sub rsp, 8  ; Align stack\n";
-                    out << "    movq [rsp], xmm1  ; Save y\n";
-                    out << "    call floor  ; Get floor(x/y)\n";
-                    out << "    movsd xmm1, [rsp]  ; Restore y from stack\n";
-                    out << "    add rsp, 8  ; Restore stack\n";
-                    
-                    out << "    mulsd xmm0, xmm1  ; y * floor(x/y)\n";
-                    out << "    movsd xmm1, xmm2  ; Restore x\n";
-                    out << "    subsd xmm1, xmm0  ; x - y * floor(x/y)\n";
-                    out << "    movsd xmm0, xmm1\n";
-                    out << "    call push_stack\n";
-                }
-                else if (token.strValue == "!") {
-                    out << "    ; Factorial\n";
-                    out << "    call pop_stack  ; Get operand into xmm0\n";
-                    
-                    // Convert to integer and compute factorial
-                    labelCounter++;
-                    out << "    ; Convert to integer\n";
-                    out << "    cvttsd2si rax, xmm0\n";
-                    
-                    // Check if conversion was accurate - factorial only defined for non-negative integers
-                    out << "    cvtsi2sd xmm1, rax\n";
-                    out << "    ucomisd xmm0, xmm1\n";
-                    out << "    jne factorial_error_" << labelCounter << "\n";
-                    
-                    out << "    ; Check if n < 0\n";
-                    out << "    test rax, rax\n";
-                    out << "    js factorial_error_" << labelCounter << "\n";
-                    
-                    // Check for potential overflow - factorial grows very quickly
-                    out << "    ; Check for potential overflow (n > 20 will overflow 64-bit)\n";
-                    out << "    cmp rax, 20\n";
-                    out << "    jg factorial_overflow_" << labelCounter << "\n";
-                    
-                    out << "    ; Compute factorial\n";
-                    out << "    mov rcx, 1  ; Result\n";
-                    out << "    test rax, rax\n";
-                    out << "    jz factorial_done_" << labelCounter << "  ; 0! = 1\n";
-                    
-                    out << "factorial_loop_" << labelCounter << ":\n";
-                    out << "    imul rcx, rax  ; result *= n\n";
-                    // Check for multiplication overflow
-                    out << "    jo factorial_overflow_" << labelCounter << "  ; Jump if overflow occurred\n";
-                    out << "    dec rax        ; n--\n";
-                    out << "    jnz factorial_loop_" << labelCounter << "\n";
-                    
-                    out << "factorial_done_" << labelCounter << ":\n";
-                    out << "    cvtsi2sd xmm0, rcx  ; Convert result to double\n";
-                    out << "    jmp factorial_end_" << labelCounter << "\n";
-                    
-                    out << "factorial_overflow_" << labelCounter << ":\n";
-                    out << "    ; Handle overflow - calculate using floating-point for large values\n";
-                    out << "    ; Simple implementation - convert back to double to avoid overflow\n";
-                    out << "    cvtsi2sd xmm0, rax  ; Convert n to double\n";
-                    out << "    movsd xmm2, __float64__(1.0)  ; Result\n";
-                    
-                    out << "factorial_fp_loop_" << labelCounter << ":\n";
-                    out << "    mulsd xmm2, xmm0  ; result *= n\n";
-                    out << "    subsd xmm0, __float64__(1.0)  ; n--\n";
-                    out << "    movsd xmm3, __float64__(0.0)  ; For comparison\n";
-                    out << "    ucomisd xmm0, xmm3\n";
-                    out << "    ja factorial_fp_loop_" << labelCounter << "\n";
-                    
-                    out << "    movsd xmm0, xmm2  ; Move result to xmm0\n";
-                    out << "    jmp factorial_end_" << labelCounter << "\n";
-                    
-                    out << "factorial_error_" << labelCounter << ":\n";
-                    out << "    ; Factorial not defined for this input (not a non-negative integer)\n";
-                    out << "    movsd xmm0, __float64__(0.0)  ; Return 0 as error value\n";
-                    
-                    out << "factorial_end_" << labelCounter << ":\n";
-                    out << "    call push_stack\n";
-                }
-                break;
-            }
-            
-            case Token::FUNCTION: {
-                int arity = operatorArities[token.strValue];
-                
-                out << "    ; Check if we have enough operands\n";
-                out << "    cmp r12, " << arity << "\n";
-                out << "    jl stack_underflow\n\n";
-                
-                if (token.strValue == "abs") {
-                    out << "    ; Absolute value\n";
-                    out << "    call pop_stack  ; Get operand into xmm0\n";
-                    out << "    andpd xmm0, [rel __m128d_abs_mask]\n";
-                    out << "    call push_stack\n";
-                }
-                else if (token.strValue == "sin") {
-                    out << "    ; Sine function\n";
-                    out << "    call pop_stack  ; Get operand into xmm0\n";
-                    out << "    sub rsp, 8  ; Align stack\n";
-                    out << "    call sin\n";
-                    out << "    add rsp, 8  ; Restore stack\n";
-                    out << "    call push_stack\n";
-                }
-                else if (token.strValue == "cos") {
-                    out << "    ; Cosine function\n";
-                    out << "    call pop_stack  ; Get operand into xmm0\n";
-                    out << "    sub rsp, 8  ; Align stack\n";
-                    out << "    call cos\n";
-                    out << "    add rsp, 8  ; Restore stack\n";
-                    out << "    call push_stack\n";
-                }
-                else if (token.strValue == "tan") {
-                    out << "    ; Tangent function\n";
-                    out << "    call pop_stack  ; Get operand into xmm0\n";
-                    out << "    sub rsp, 8  ; Align stack\n";
-                    out << "    call tan\n";
-                    out << "    add rsp, 8  ; Restore stack\n";
-                    out << "    call push_stack\n";
-                }
-                else if (token.strValue == "sqrt") {
-                    out << "    ; Square root\n";
-                    out << "    call pop_stack  ; Get operand into xmm0\n";
-                    out << "    sqrtsd xmm0, xmm0\n";
-                    out << "    call push_stack\n";
-                }
-                break;
-            }
-            
-            case Token::STACK_OP: {
-                int arity = operatorArities[token.strValue];
-                
-                out << "    ; Check if we have enough operands\n";
-                out << "    cmp r12, " << arity << "\n";
-                out << "    jl stack_underflow\n\n";
-                
-                if (token.strValue == "swap") {
-                    out << "    ; Swap top two stack elements\n";
-                    out << "    mov rax, r12\n";
-                    out << "    dec rax\n";
-                    out << "    movsd xmm0, [rbp + 8*rax]\n";  // Top item
-                    out << "    mov rbx, rax\n";
-                    out << "    dec rbx\n";
-                    out << "    movsd xmm1, [rbp + 8*rbx]\n";  // Second item
-                    out << "    movsd [rbp + 8*rax], xmm1\n";
-                    out << "    movsd [rbp + 8*rbx], xmm0\n";
-                }
-                else if (token.strValue == "dup") {
-                    out << "    ; Duplicate top stack element\n";
-                    out << "    call pop_stack\n";  // Get top item
-                    out << "    call push_stack\n";  // Push it back
-                    out << "    call push_stack\n";  // Push it again
-                }
-                break;
-            }
+    // Known up front, since the report in main comes before the
+    // multiversion bodies
+    profiledLines.clear();
+    for (const Token& token : tokens) {
+        if (sourceLine(token) > 0) {
+            profiledLines.insert(sourceLine(token));
         }
-        
-        out << "\n";
+    }
+    TargetFeatures baseline;
+    
+    if (options.multiversion) {
+        // The expression is emitted twice below; pick one based on CPUID
+        out << "    ; Select the expression version supported by this CPU\n";
+        out << "    push rbx  ; cpuid clobbers rbx\n";
+        out << "    mov eax, 1\n";
+        out << "    cpuid\n";
+        out << "    pop rbx\n";
+        out << "    ; Require FMA (bit 12), OSXSAVE (bit 27) and AVX (bit 28)\n";
+        out << "    and ecx, 0x18001000\n";
+        out << "    cmp ecx, 0x18001000\n";
+        out << "    jne use_expression_sse2\n";
+        out << "    ; Check the OS saves XMM and YMM state\n";
+        out << "    xor ecx, ecx\n";
+        out << "    xgetbv\n";
+        out << "    and eax, 6\n";
+        out << "    cmp eax, 6\n";
+        out << "    jne use_expression_sse2\n";
+        out << "    call expression_fma\n";
+        out << "    jmp expression_done\n";
+        out << "use_expression_sse2:\n";
+        out << "    call expression_sse2\n";
+        out << "expression_done:\n\n";
+    } else {
+        emitFeatures = options.features;
+        generateBody(tokens, out, labelCounter);
     }
     
     // Print the final result
     out << "    ; Print the final result\n";
     out << "    call pop_stack\n";
+    if (invalidResultCheck) {
+        // The single status check: NaN compares unordered, infinity equal
+        out << "    ; Check the result is finite\n";
+        emitSSE(out, "movsd", "xmm1", "xmm0");
+        emitSSE(out, "andpd", "xmm1", absMask());
+        emitSSE(out, "ucomisd", "xmm1", poolConstant(std::numeric_limits<double>::infinity(), "inf"));
+        out << "    jp invalid_result\n";
+        out << "    jae invalid_result\n";
+    }
+    if (emitPrecision == PRECISION_SINGLE) {
+        emitSSE(out, "cvtss2sd", "xmm0", "xmm0", "printf takes a double");
+    }
     out << "    lea rdi, [rel format]\n";
     out << "    mov rax, 1  ; One floating point argument\n";
     out << "    call printf\n\n";
     
+    if (options.profile) {
+        emitProfileReport(out);
+    }
+    
     // Exit program
     out << "    ; Exit program\n";
     out << "    xor rdi, rdi\n";
     out << "    call exit\n\n";
     
-    // Add helper functions
+    if (options.multiversion) {
+        TargetFeatures fma;
+        fma.avx = true;
+        fma.fma = true;
+        
+        // The call pushed a return address, so each version realigns the
+        // stack for the body the way main's frame does
+        out << "expression_sse2:\n";
+        out << "    ; Baseline SSE2 version\n";
+        out << "    sub rsp, 8  ; Align stack\n";
+        emitFeatures = baseline;
+        generateBody(tokens, out, labelCounter);
+        out << "    add rsp, 8  ; Restore stack\n";
+        out << "    ret\n\n";
+        
+        out << "expression_fma:\n";
+        out << "    ; AVX/FMA version\n";
+        out << "    sub rsp, 8  ; Align stack\n";
+        emitFeatures = fma;
+        generateBody(tokens, out, labelCounter);
+        out << "    add rsp, 8  ; Restore stack\n";
+        out << "    vzeroupper\n";
+        out << "    ret\n\n";
+        
+        // The helpers are shared, so keep them in the baseline encoding
+        emitFeatures = baseline;
+    }
+    
+    if (!options.sharedRuntime) {
+        emitRuntimeHelpers(out, invalidResultCheck);
+    }
+    
+    // Data section
+    out << "section .rodata align=16\n";
+    if (!options.sharedRuntime) {
+        out << "    __m128d_abs_mask dq 0x7FFFFFFFFFFFFFFF, 0x7FFFFFFFFFFFFFFF\n";
+    }
+    if (emitPrecision == PRECISION_SINGLE) {
+        out << "    __m128_abs_mask dd 0x7FFFFFFF, 0x7FFFFFFF, 0x7FFFFFFF, 0x7FFFFFFF\n";
+    }
+    
+    // Constant pool, one exact bit pattern per distinct value and width.
+    // Doubles come first so none lands on a 4-byte offset after a float.
+    for (int pass = 0; pass < 2; pass++) {
+        bool single = pass == 1;
+        for (size_t i = 0; i < constantOrder.size(); i++) {
+            if (constantOrder[i].single != single) {
+                continue;
+            }
+            char bits[24];
+            if (single) {
+                std::snprintf(bits, sizeof(bits), "dd 0x%08llX", static_cast<unsigned long long>(constantOrder[i].bits));
+            } else {
+                std::snprintf(bits, sizeof(bits), "dq 0x%016llX", static_cast<unsigned long long>(constantOrder[i].bits));
+            }
+            out << "    __const_" << i << " " << bits;
+            if (!constantOrder[i].name.empty()) {
+                out << "  ; " << constantOrder[i].name;
+            }
+            out << "\n";
+        }
+    }
+    if (options.profile) {
+        emitProfileData(out);
+    }
+    out << "\n";
+    
+    // External functions for math operations
+    std::string suffix = emitPrecision == PRECISION_SINGLE ? "f" : "";
+    out << "    extern floor" << suffix << "\n";
+    out << "    extern log" << suffix << "\n";
+    out << "    extern exp" << suffix << "\n";
+    out << "    extern sin" << suffix << "\n";
+    out << "    extern cos" << suffix << "\n";
+    out << "    extern tan" << suffix << "\n";
+}
+
+void Compiler::generateRuntime(std::ostream& out) {
+    AssemblyBuffer buffer;
+    generateRuntime(buffer);
+    out.write(buffer.text.data(), static_cast<std::streamsize>(buffer.text.size()));
+}
+
+void Compiler::generateRuntime(AssemblyBuffer& out) {
+    out << "; Math compiler runtime\n";
+    out << "; Helpers shared by expressions compiled with -shared-runtime\n\n";
+    
+    emitRuntimeData(out, true);
+    out << "    global format\n";
+    out << "    global div_zero_msg\n";
+    out << "    global stack_underflow_msg\n";
+    out << "    global invalid_result_msg\n";
+    
+    out << "\nsection .text\n";
+    out << "    global push_stack\n";
+    out << "    global pop_stack\n";
+    out << "    global division_by_zero\n";
+    out << "    global stack_underflow\n";
+    out << "    global invalid_result\n";
+    out << "    extern printf\n";
+    out << "    extern exit\n\n";
+    
+    // Expressions of every target call the same helpers
+    emitFeatures = TargetFeatures();
+    emitPrecision = PRECISION_DOUBLE;
+    emitRuntimeHelpers(out, true);
+    
+    out << "section .rodata align=16\n";
+    out << "    global __m128d_abs_mask\n";
+    out << "    __m128d_abs_mask dq 0x7FFFFFFFFFFFFFFF, 0x7FFFFFFFFFFFFFFF\n";
+}
+
+void Compiler::emitRuntimeData(AssemblyBuffer& out, bool invalidResult) {
+    out << "section .data\n";
+    // Define constants used in the program
+    out << "    format db \"%lf\", 10, 0  ; Format for printf\n";
+    out << "    div_zero_msg db \"Error: Division by zero\", 10, 0\n";
+    out << "    stack_underflow_msg db \"Error: Stack underflow\", 10, 0\n";
+    if (invalidResult) {
+        out << "    invalid_result_msg db \"Error: Result is not finite\", 10, 0\n";
+    }
+}
+
+void Compiler::emitRuntimeHelpers(AssemblyBuffer& out, bool invalidResult) {
     out << "push_stack:\n";
     out << "    ; Push value in xmm0 to stack\n";
     out << "    mov rax, r12\n";
-    out << "    movsd [rbp + 8*rax], xmm0\n";
+    emitSSE(out, "movsd", stackSlot("rax"), "xmm0");
     out << "    inc r12\n";
     out << "    ret\n\n";
     
@@ -466,7 +564,7 @@ void Compiler::generateAssembly(const std::vector<Token>& tokens, std::ostream&
     out << "    ; Pop value from stack to xmm0\n";
     out << "    dec r12\n";
     out << "    mov rax, r12\n";
-    out << "    movsd xmm0, [rbp + 8*rax]\n";
+    emitSSE(out, "movsd", "xmm0", stackSlot("rax"));
     out << "    ret\n\n";
     
     // Error handlers
@@ -486,15 +584,722 @@ void Compiler::generateAssembly(const std::vector<Token>& tokens, std::ostream&
     out << "    mov rdi, 2  ; Exit code 2\n";
     out << "    call exit\n\n";
     
-    // Data section
-    out << "section .rodata\n";
-    out << "    __m128d_abs_mask dq 0x7FFFFFFFFFFFFFFF, 0x7FFFFFFFFFFFFFFF\n";
+    if (invalidResult) {
+        out << "invalid_result:\n";
+        out << "    ; Handle a NaN or infinite result in the NaN error modes\n";
+        out << "    lea rdi, [rel invalid_result_msg]\n";
+        out << "    xor rax, rax\n";
+        out << "    call printf\n";
+        out << "    mov rdi, 3  ; Exit code 3\n";
+        out << "    call exit\n\n";
+    }
+}
+
+void Compiler::generateBody(const std::vector<Token>& tokens, AssemblyBuffer& out, int& labelCounter) {
+    int previousLine = 0;
+    for (size_t i = 0; i < tokens.size(); i++) {
+        const Token& token = tokens[i];
+        int line = beginWord(out, token, previousLine);
+        
+        switch (token.type) {
+            case Token::NUMBER:
+            case Token::CONSTANT:
+            case Token::VARIABLE: {
+                out << "    ; Push " << (token.type == Token::NUMBER ? "number" : "constant") << " onto stack\n";
+                emitLoad(out, token, "xmm0");
+                out << "    call push_stack\n";
+                break;
+            }
+            
+            case Token::OPERATOR: {
+                const OperatorInfo& info = operators.at(token.strValue);
+                
+                // With FMA, fold a multiplication into the addition or
+                // subtraction that consumes it. Each absorbed token keeps its
+                // own %line and profile counts; the fused instruction belongs
+                // to the + or - that completes it.
+                if (emitFeatures.fma && info.operation == OP_MUL) {
+                    if (i + 1 < tokens.size() && isAddOrSub(tokens[i + 1])) {
+                        // c a b * +  ->  c + a*b
+                        bool add = operation(tokens[i + 1]) == OP_ADD;
+                        out << "    ; Fused with following " << tokens[i + 1].strValue << "\n";
+                        emitOperandCheck(out, 3);
+                        out << "    call pop_stack  ; Get b into xmm0\n";
+                        emitSSE(out, "movsd", "xmm1", "xmm0");
+                        out << "    call pop_stack  ; Get a into xmm0\n";
+                        emitSSE(out, "movsd", "xmm2", "xmm0");
+                        emitProfileEnd(out, line);
+                        
+                        int addLine = beginWord(out, tokens[i + 1], previousLine);
+                        out << "    call pop_stack  ; Get c into xmm0\n";
+                        out << "    " << scalar(add ? "vfmadd231sd" : "vfnmadd231sd")
+                            << " xmm0, xmm2, xmm1  ; xmm0 = xmm0 " << (add ? "+" : "-") << " a*b\n";
+                        out << "    call push_stack\n";
+                        emitProfileEnd(out, addLine);
+                        out << "\n";
+                        i += 1;
+                        continue;
+                    }
+                    if (i + 2 < tokens.size() && isLeaf(tokens[i + 1]) && isAddOrSub(tokens[i + 2])) {
+                        // a b * c +  ->  a*b + c
+                        bool add = operation(tokens[i + 2]) == OP_ADD;
+                        out << "    ; Fused with following " << tokens[i + 1].strValue
+                            << " " << tokens[i + 2].strValue << "\n";
+                        emitOperandCheck(out, 2);
+                        out << "    call pop_stack  ; Get b into xmm0\n";
+                        emitSSE(out, "movsd", "xmm1", "xmm0");
+                        out << "    call pop_stack  ; Get a into xmm0\n";
+                        emitProfileEnd(out, line);
+                        
+                        int leafLine = beginWord(out, tokens[i + 1], previousLine);
+                        emitLoad(out, tokens[i + 1], "xmm2");
+                        emitProfileEnd(out, leafLine);
+                        
+                        int addLine = beginWord(out, tokens[i + 2], previousLine);
+                        out << "    " << scalar(add ? "vfmadd213sd" : "vfmsub213sd")
+                            << " xmm0, xmm1, xmm2  ; xmm0 = a*b " << (add ? "+" : "-") << " c\n";
+                        out << "    call push_stack\n";
+                        emitProfileEnd(out, addLine);
+                        out << "\n";
+                        i += 2;
+                        continue;
+                    }
+                }
+                
+                emitOperandCheck(out, info.arity);
+                
+                switch (info.operation) {
+                    case OP_ADD: {
+                        out << "    ; Addition\n";
+                        out << "    call pop_stack  ; Get first operand into xmm0\n";
+                        emitSSE(out, "movsd", "xmm1", "xmm0");
+                        out << "    call pop_stack  ; Get second operand into xmm0\n";
+                        emitSSE(out, "addsd", "xmm0", "xmm1");
+                        out << "    call push_stack\n";
+                        break;
+                    }
+                    case OP_SUB: {
+                        out << "    ; Subtraction\n";
+                        out << "    call pop_stack  ; Get first operand into xmm0\n";
+                        emitSSE(out, "movsd", "xmm1", "xmm0");
+                        out << "    call pop_stack  ; Get second operand into xmm0\n";
+                        emitSSE(out, "subsd", "xmm0", "xmm1");
+                        out << "    call push_stack\n";
+                        break;
+                    }
+                    case OP_MUL: {
+                        out << "    ; Multiplication\n";
+                        out << "    call pop_stack  ; Get first operand into xmm0\n";
+                        emitSSE(out, "movsd", "xmm1", "xmm0");
+                        out << "    call pop_stack  ; Get second operand into xmm0\n";
+                        emitSSE(out, "mulsd", "xmm0", "xmm1");
+                        out << "    call push_stack\n";
+                        break;
+                    }
+                    case OP_DIV: {
+                        out << "    ; Division\n";
+                        out << "    call pop_stack  ; Get divisor into xmm0\n";
+                        emitZeroDivisorCheck(out);
+                        emitSSE(out, "movsd", "xmm1", "xmm0");
+                        out << "    call pop_stack  ; Get dividend into xmm0\n";
+                        emitSSE(out, "divsd", "xmm0", "xmm1");
+                        out << "    call push_stack\n";
+                        break;
+                    }
+                    case OP_POW: {
+                        // We'll use the C library pow function
+                        labelCounter++;
+                        out << "    ; Power (x^y)\n";
+                        out << "    call pop_stack  ; Get exponent into xmm0\n";
+                        emitSSE(out, "movsd", "xmm1", "xmm0");
+                        out << "    call pop_stack  ; Get base into xmm0\n";
+                        
+                        // We use a simple approach for integer powers
+                        out << "    ; Check if exponent is an integer\n";
+                        emitSSE(out, "cvttsd2si", "rax", "xmm1", "Convert to integer truncating");
+                        emitSSE(out, "cvtsi2sd", "xmm2", "rax", "Convert back to double");
+                        emitSSE(out, "ucomisd", "xmm1", "xmm2", "Compare original and converted value");
+                        out << "    jne power_general_" << labelCounter << "\n";
+                        
+                        // Integer power implementation
+                        out << "    ; Integer power implementation\n";
+                        emitSSE(out, "movsd", "xmm2", poolConstant(1.0), "Result accumulator");
+                        out << "    test rax, rax\n";
+                        out << "    jz power_integer_done_" << labelCounter << "  ; x^0 = 1\n";
+                        out << "    js power_general_" << labelCounter << "  ; Negative exponent needs general case\n";
+                        
+                        out << "power_loop_" << labelCounter << ":\n";
+                        out << "    test rax, 1\n";
+                        out << "    jz power_skip_" << labelCounter << "\n";
+                        emitSSE(out, "mulsd", "xmm2", "xmm0", "Multiply result by x");
+                        out << "power_skip_" << labelCounter << ":\n";
+                        emitSSE(out, "mulsd", "xmm0", "xmm0", "Square x");
+                        out << "    shr rax, 1        ; Divide exponent by 2\n";
+                        out << "    jnz power_loop_" << labelCounter << "\n";
+                        out << "power_integer_done_" << labelCounter << ":\n";
+                        emitSSE(out, "movsd", "xmm0", "xmm2");
+                        out << "    jmp power_done_" << labelCounter << "\n";
+                        
+                        // General power using exp and log
+                        out << "power_general_" << labelCounter << ":\n";
+                        out << "    ; x^y = exp(y * ln(x))\n";
+                        out << "    ; Check if x > 0 for log\n";
+                        emitSSE(out, "xorpd", "xmm2", "xmm2");
+                        emitSSE(out, "ucomisd", "xmm0", "xmm2");
+                        out << "    jbe power_error_" << labelCounter << "  ; If x <= 0, can't take log\n";
+                        
+                        // y is saved above rsp, where the calls cannot overwrite it
+                        out << "    sub rsp, 16  ; Reserve a slot for y, keeping the stack aligned\n";
+                        emitSSE(out, "movq", "[rsp]", "xmm1", "Save y");
+                        
+                        emitCall(out, "log", "Get ln(x) in xmm0");
+                        emitSSE(out, "movsd", "xmm1", "[rsp]", "Restore y to xmm1");
+                        emitSSE(out, "mulsd", "xmm0", "xmm1", "y * ln(x)");
+                        emitCall(out, "exp", "exp(y * ln(x))");
+                        
+                        out << "    add rsp, 16  ; Restore stack\n";
+                        out << "    jmp power_done_" << labelCounter << "\n";
+                        
+                        out << "power_error_" << labelCounter << ":\n";
+                        out << "    ; Handle error case (probably not ideal but simple)\n";
+                        emitSSE(out, "movsd", "xmm0", errorValue());
+                        
+                        out << "power_done_" << labelCounter << ":\n";
+                        out << "    call push_stack\n";
+                        break;
+                    }
+                    case OP_MOD: {
+                        out << "    ; Modulus\n";
+                        out << "    call pop_stack  ; Get second operand into xmm0\n";
+                        emitZeroDivisorCheck(out);
+                        emitSSE(out, "movsd", "xmm1", "xmm0");
+                        out << "    call pop_stack  ; Get first operand into xmm0\n";
+                        
+                        // Implementation of floating-point modulus
+                        labelCounter++;
+                        out << "    ; Floating-point modulus: x % y = x - y * floor(x/y)\n";
+                        emitSSE(out, "movsd", "xmm2", "xmm0", "Save x");
+                        emitSSE(out, "divsd", "xmm0", "xmm1", "x / y");
+                        
+                        // Compute floor(x/y)
+                        // XMM registers are not preserved across the call
+                        out << "    sub rsp, 16  ; Reserve slots for y and x, keeping the stack aligned\n";
+                        emitSSE(out, "movq", "[rsp]", "xmm1", "Save y");
+                        emitSSE(out, "movq", "[rsp+8]", "xmm2", "Save x");
+                        emitCall(out, "floor", "Get floor(x/y)");
+                        emitSSE(out, "movsd", "xmm1", "[rsp]", "Restore y from stack");
+                        emitSSE(out, "movsd", "xmm2", "[rsp+8]", "Restore x from stack");
+                        out << "    add rsp, 16  ; Restore stack\n";
+                        
+                        emitSSE(out, "mulsd", "xmm0", "xmm1", "y * floor(x/y)");
+                        emitSSE(out, "movsd", "xmm1", "xmm2", "Restore x");
+                        emitSSE(out, "subsd", "xmm1", "xmm0", "x - y * floor(x/y)");
+                        emitSSE(out, "movsd", "xmm0", "xmm1");
+                        out << "    call push_stack\n";
+                        break;
+                    }
+                    case OP_FACT: {
+                        out << "    ; Factorial\n";
+                        out << "    call pop_stack  ; Get operand into xmm0\n";
+                        
+                        // Convert to integer and compute factorial
+                        labelCounter++;
+                        out << "    ; Convert to integer\n";
+                        emitSSE(out, "cvttsd2si", "rax", "xmm0");
+                        
+                        // Check if conversion was accurate - factorial only defined for non-negative integers
+                        emitSSE(out, "cvtsi2sd", "xmm1", "rax");
+                        emitSSE(out, "ucomisd", "xmm0", "xmm1");
+                        out << "    jne factorial_error_" << labelCounter << "\n";
+                        
+                        out << "    ; Check if n < 0\n";
+                        out << "    test rax, rax\n";
+                        out << "    js factorial_error_" << labelCounter << "\n";
+                        
+                        // Check for potential overflow - factorial grows very quickly
+                        out << "    ; Check for potential overflow (n > 20 will overflow 64-bit)\n";
+                        out << "    cmp rax, 20\n";
+                        out << "    jg factorial_overflow_" << labelCounter << "\n";
+                        
+                        out << "    ; Compute factorial\n";
+                        out << "    mov rcx, 1  ; Result\n";
+                        out << "    test rax, rax\n";
+                        out << "    jz factorial_done_" << labelCounter << "  ; 0! = 1\n";
+                        
+                        out << "factorial_loop_" << labelCounter << ":\n";
+                        out << "    imul rcx, rax  ; result *= n\n";
+                        // Check for multiplication overflow
+                        out << "    jo factorial_overflow_" << labelCounter << "  ; Jump if overflow occurred\n";
+                        out << "    dec rax        ; n--\n";
+                        out << "    jnz factorial_loop_" << labelCounter << "\n";
+                        
+                        out << "factorial_done_" << labelCounter << ":\n";
+                        emitSSE(out, "cvtsi2sd", "xmm0", "rcx", "Convert result to double");
+                        out << "    jmp factorial_end_" << labelCounter << "\n";
+                        
+                        out << "factorial_overflow_" << labelCounter << ":\n";
+                        out << "    ; Handle overflow - calculate using floating-point for large values\n";
+                        out << "    ; Simple implementation - convert back to double to avoid overflow\n";
+                        emitSSE(out, "cvtsi2sd", "xmm0", "rax", "Convert n to double");
+                        emitSSE(out, "movsd", "xmm2", poolConstant(1.0), "Result");
+                        
+                        out << "factorial_fp_loop_" << labelCounter << ":\n";
+                        emitSSE(out, "mulsd", "xmm2", "xmm0", "result *= n");
+                        emitSSE(out, "subsd", "xmm0", poolConstant(1.0), "n--");
+                        emitSSE(out, "movsd", "xmm3", poolConstant(0.0), "For comparison");
+                        emitSSE(out, "ucomisd", "xmm0", "xmm3");
+                        out << "    ja factorial_fp_loop_" << labelCounter << "\n";
+                        
+                        emitSSE(out, "movsd", "xmm0", "xmm2", "Move result to xmm0");
+                        out << "    jmp factorial_end_" << labelCounter << "\n";
+                        
+                        out << "factorial_error_" << labelCounter << ":\n";
+                        out << "    ; Factorial not defined for this input (not a non-negative integer)\n";
+                        emitSSE(out, "movsd", "xmm0", errorValue(), "Return error value");
+                        
+                        out << "factorial_end_" << labelCounter << ":\n";
+                        out << "    call push_stack\n";
+                        break;
+                    }
+                    case OP_LT:
+                    case OP_GT: {
+                        // Branch-free: the compare leaves an all-ones or all-zeros mask
+                        bool less = info.operation == OP_LT;
+                        out << "    ; Comparison (" << (less ? "a < b" : "a > b") << " gives 1, otherwise 0)\n";
+                        out << "    call pop_stack  ; Get b into xmm0\n";
+                        emitSSE(out, "movsd", "xmm1", "xmm0");
+                        out << "    call pop_stack  ; Get a into xmm0\n";
+                        if (less) {
+                            emitSSE(out, "cmpltsd", "xmm0", "xmm1", "Mask is all ones if a < b");
+                        } else {
+                            emitSSE(out, "cmpltsd", "xmm1", "xmm0", "Mask is all ones if b < a");
+                            emitSSE(out, "movsd", "xmm0", "xmm1");
+                        }
+                        emitSSE(out, "movsd", "xmm2", poolConstant(1.0));
+                        emitSSE(out, "andpd", "xmm0", "xmm2", "1.0 where the mask is set");
+                        out << "    call push_stack\n";
+                        break;
+                    }
+                    default:
+                        break;
+                }
+                break;
+            }
+            
+            case Token::FUNCTION: {
+                const OperatorInfo& info = operators.at(token.strValue);
+                
+                emitOperandCheck(out, info.arity);
+                
+                switch (info.operation) {
+                    case OP_ABS: {
+                        out << "    ; Absolute value\n";
+                        out << "    call pop_stack  ; Get operand into xmm0\n";
+                        emitSSE(out, "andpd", "xmm0", absMask());
+                        out << "    call push_stack\n";
+                        break;
+                    }
+                    case OP_SIN: {
+                        out << "    ; Sine function\n";
+                        out << "    call pop_stack  ; Get operand into xmm0\n";
+                        emitCall(out, "sin");
+                        out << "    call push_stack\n";
+                        break;
+                    }
+                    case OP_COS: {
+                        out << "    ; Cosine function\n";
+                        out << "    call pop_stack  ; Get operand into xmm0\n";
+                        emitCall(out, "cos");
+                        out << "    call push_stack\n";
+                        break;
+                    }
+                    case OP_TAN: {
+                        out << "    ; Tangent function\n";
+                        out << "    call pop_stack  ; Get operand into xmm0\n";
+                        emitCall(out, "tan");
+                        out << "    call push_stack\n";
+                        break;
+                    }
+                    case OP_SQRT: {
+                        out << "    ; Square root\n";
+                        out << "    call pop_stack  ; Get operand into xmm0\n";
+                        emitSSE(out, "sqrtsd", "xmm0", "xmm0");
+                        out << "    call push_stack\n";
+                        break;
+                    }
+                    case OP_LN: {
+                        out << "    ; Natural logarithm\n";
+                        out << "    call pop_stack  ; Get operand into xmm0\n";
+                        emitCall(out, "log");
+                        out << "    call push_stack\n";
+                        break;
+                    }
+                    case OP_MIN:
+                    case OP_MAX: {
+                        // minsd/maxsd return b when the operands are unordered
+                        bool min = info.operation == OP_MIN;
+                        out << "    ; " << (min ? "Minimum" : "Maximum") << "\n";
+                        out << "    call pop_stack  ; Get b into xmm0\n";
+                        emitSSE(out, "movsd", "xmm1", "xmm0");
+                        out << "    call pop_stack  ; Get a into xmm0\n";
+                        emitSSE(out, min ? "minsd" : "maxsd", "xmm0", "xmm1");
+                        out << "    call push_stack\n";
+                        break;
+                    }
+                    case OP_SELECT: {
+                        // a b c select is a when c is nonzero (or NaN), else b
+                        out << "    ; Select without branching\n";
+                        out << "    call pop_stack  ; Get c into xmm0\n";
+                        emitSSE(out, "movsd", "xmm2", "xmm0");
+                        out << "    call pop_stack  ; Get b into xmm0\n";
+                        emitSSE(out, "movsd", "xmm1", "xmm0");
+                        out << "    call pop_stack  ; Get a into xmm0\n";
+                        emitSSE(out, "xorpd", "xmm3", "xmm3");
+                        emitSSE(out, "cmpneqsd", "xmm2", "xmm3", "Mask is all ones if c != 0");
+                        if (emitFeatures.avx) {
+                            out << "    " << scalar("vblendvpd") << " xmm0, xmm1, xmm0, xmm2  ; Mask ? a : b\n";
+                        } else {
+                            emitSSE(out, "andpd", "xmm0", "xmm2", "a where the mask is set");
+                            emitSSE(out, "andnpd", "xmm2", "xmm1", "b where it is clear");
+                            emitSSE(out, "orpd", "xmm0", "xmm2");
+                        }
+                        out << "    call push_stack\n";
+                        break;
+                    }
+                    default:
+                        break;
+                }
+                break;
+            }
+            
+            case Token::STACK_OP: {
+                const OperatorInfo& info = operators.at(token.strValue);
+                
+                emitOperandCheck(out, info.arity);
+                
+                switch (info.operation) {
+                    case OP_SWAP: {
+                        out << "    ; Swap top two stack elements\n";
+                        out << "    mov rax, r12\n";
+                        out << "    dec rax\n";
+                        emitSSE(out, "movsd", "xmm0", stackSlot("rax"));  // Top item
+                        out << "    mov rbx, rax\n";
+                        out << "    dec rbx\n";
+                        emitSSE(out, "movsd", "xmm1", stackSlot("rbx"));  // Second item
+                        emitSSE(out, "movsd", stackSlot("rax"), "xmm1");
+                        emitSSE(out, "movsd", stackSlot("rbx"), "xmm0");
+                        break;
+                    }
+                    case OP_DUP: {
+                        out << "    ; Duplicate top stack element\n";
+                        out << "    call pop_stack\n";  // Get top item
+                        out << "    call push_stack\n";  // Push it back
+                        out << "    call push_stack\n";  // Push it again
+                        break;
+                    }
+                    default:
+                        break;
+                }
+                break;
+            }
+        }
+        
+        emitProfileEnd(out, line);
+        out << "\n";
+    }
     
-    // External functions for math operations
-    out << "    extern floor\n";
-    out << "    extern log\n";
-    out << "    extern exp\n";
-    out << "    extern sin\n";
-    out << "    extern cos\n";
-    out << "    extern tan\n";
-} 
\ No newline at end of file
+    // Code after the expression belongs to no source word (DWARF line 0)
+    if (options.debugLines) {
+        out << "%line 0+0 " << listingName << "\n";
+    }
+}
+
+void Compiler::emitOperandCheck(AssemblyBuffer& out, int count) {
+    // In the NaN modes the stack depth is verified at compile time
+    if (options.errorMode != ERRORS_BRANCH) {
+        return;
+    }
+    out << "    ; Check if we have enough operands\n";
+    out << "    cmp r12, " << count << "\n";
+    out << "    jl stack_underflow\n\n";
+}
+
+void Compiler::emitZeroDivisorCheck(AssemblyBuffer& out) {
+    // Without the check, x/0 gives infinity or NaN
+    if (options.errorMode != ERRORS_BRANCH) {
+        return;
+    }
+    out << "    ; Check if divisor is zero\n";
+    emitSSE(out, "xorpd", "xmm1", "xmm1");
+    emitSSE(out, "ucomisd", "xmm0", "xmm1");
+    out << "    je division_by_zero\n";
+}
+
+std::string Compiler::errorValue() {
+    if (options.errorMode == ERRORS_BRANCH) {
+        return poolConstant(0.0);
+    }
+    return poolConstant(std::numeric_limits<double>::quiet_NaN(), "NaN");
+}
+
+void Compiler::checkStackDepth(const std::vector<Token>& tokens) {
+    int depth = 0;
+    for (const Token& token : tokens) {
+        if (token.isValue()) {
+            depth++;
+            continue;
+        }
+        const OperatorInfo& info = operators.at(token.strValue);
+        if (depth < info.arity) {
+            throw std::runtime_error("Stack underflow");
+        }
+        if (info.operation == OP_DUP) {
+            depth++;
+        } else if (info.operation != OP_SWAP) {
+            depth -= info.arity - 1;
+        }
+    }
+    
+    // The result is popped for printing
+    if (depth == 0) {
+        throw std::runtime_error("Stack underflow");
+    }
+}
+
+int Compiler::sourceLine(const Token& token) const {
+    if (token.offset < 0) {
+        return 0;
+    }
+    // sourceWords is sorted by offset
+    auto word = std::lower_bound(sourceWords.begin(), sourceWords.end(), static_cast<size_t>(token.offset),
+                                 [](const SourceWord& w, size_t offset) { return w.offset < offset; });
+    if (word == sourceWords.end() || word->offset != static_cast<size_t>(token.offset)) {
+        return 0;
+    }
+    return static_cast<int>(word - sourceWords.begin()) + 1;
+}
+
+int Compiler::beginWord(AssemblyBuffer& out, const Token& token, int& previousLine) {
+    // Tokens inlined from one definition share their word's line
+    int line = sourceLine(token);
+    if (options.debugLines && line > 0 && line != previousLine) {
+        out << "%line " << line << "+0 " << listingName << "\n";
+    }
+    out << "    ; Process token: " << token.strValue << "\n";
+    emitProfileStart(out, line, line != previousLine);
+    previousLine = line;
+    return line;
+}
+
+void Compiler::emitProfileStart(AssemblyBuffer& out, int line, bool countHit) {
+    if (!options.profile || line == 0) {
+        return;
+    }
+    // r13 is callee-saved, so the start time survives calls into libm
+    out << "    ; Profile source word " << line << "\n";
+    if (countHit) {
+        out << "    inc qword [rel __profile_hits + " << 8 * (line - 1) << "]\n";
+    }
+    out << "    rdtsc\n";
+    out << "    shl rdx, 32\n";
+    out << "    or rax, rdx\n";
+    out << "    mov r13, rax  ; Start time\n";
+}
+
+void Compiler::emitProfileEnd(AssemblyBuffer& out, int line) {
+    if (!options.profile || line == 0) {
+        return;
+    }
+    out << "    rdtsc\n";
+    out << "    shl rdx, 32\n";
+    out << "    or rax, rdx\n";
+    out << "    sub rax, r13\n";
+    out << "    add [rel __profile_cycles + " << 8 * (line - 1) << "], rax  ; Add elapsed cycles\n";
+}
+
+void Compiler::emitProfileReport(AssemblyBuffer& out) {
+    out << "    ; Print the profile, one line per source word\n";
+    for (int line : profiledLines) {
+        out << "    lea rdi, [rel __profile_format]\n";
+        out << "    mov rsi, " << sourceWords[line - 1].offset << "  ; Offset in the source\n";
+        out << "    mov rdx, [rel __profile_hits + " << 8 * (line - 1) << "]\n";
+        out << "    mov rcx, [rel __profile_cycles + " << 8 * (line - 1) << "]\n";
+        out << "    lea r8, [rel __profile_word_" << line << "]\n";
+        out << "    xor rax, rax\n";
+        out << "    call printf\n";
+    }
+    out << "\n";
+}
+
+void Compiler::emitProfileData(AssemblyBuffer& out) {
+    out << "    __profile_format db \"profile: offset %-6llu hits %-10llu cycles %-12llu %s\", 10, 0\n";
+    for (int line : profiledLines) {
+        // Words are written as bytes, since they may contain quotes
+        out << "    __profile_word_" << line << " db ";
+        for (unsigned char c : sourceWords[line - 1].text) {
+            out << static_cast<int>(c) << ", ";
+        }
+        out << "0  ; " << sourceWords[line - 1].text << "\n";
+    }
+    
+    out << "\nsection .bss\n";
+    out << "    __profile_hits resq " << sourceWords.size() << "\n";
+    out << "    __profile_cycles resq " << sourceWords.size() << "\n";
+}
+
+void Compiler::emitLoad(AssemblyBuffer& out, const Token& token, const std::string& reg) {
+    if (token.type == Token::VARIABLE) {
+        throw std::runtime_error("Variable " + token.strValue + " can only be used with column evaluation");
+    }
+    double value = token.type == Token::NUMBER ? token.numValue : constants.at(token.strValue);
+    if (emitPrecision == PRECISION_MIXED) {
+        // Stored as a float, computed with as a double
+        emitSSE(out, "movss", reg, poolConstant(value, token.strValue, true));
+        emitSSE(out, "cvtss2sd", reg, reg);
+    } else {
+        emitSSE(out, "movsd", reg, poolConstant(value, token.strValue));
+    }
+}
+
+void Compiler::emitSSE(AssemblyBuffer& out, const std::string& mnemonic,
+                       const std::string& dst, const std::string& src,
+                       const std::string& comment) {
+    std::string op = scalar(mnemonic);
+    bool scalarMove = op == "movsd" || op == "movss";
+    
+    out << "    ";
+    if (!emitFeatures.avx) {
+        out << op << " " << dst << ", " << src;
+    }
+    else if (scalarMove && dst.compare(0, 3, "xmm") == 0 && src.compare(0, 3, "xmm") == 0) {
+        // Register-to-register vmovsd needs three operands; a full copy is equivalent here
+        out << (op == "movsd" ? "vmovapd " : "vmovaps ") << dst << ", " << src;
+    }
+    else if (scalarMove || op == "movq" || op == "ucomisd" || op == "ucomiss" ||
+             op == "cvttsd2si" || op == "cvttss2si") {
+        out << "v" << op << " " << dst << ", " << src;
+    }
+    else {
+        // Non-destructive three-operand form with the destination as first source
+        out << "v" << op << " " << dst << ", " << dst << ", " << src;
+    }
+    if (!comment.empty()) {
+        out << "  ; " << comment;
+    }
+    out << "\n";
+}
+
+void Compiler::emitCall(AssemblyBuffer& out, const std::string& function, const std::string& comment) {
+    // The body runs with rsp 16-byte aligned, as the System V ABI requires
+    // at a call; code that reserves stack around a call keeps it that way
+    // libm may use legacy SSE encodings, so clear the upper YMM state first
+    if (emitFeatures.avx) {
+        out << "    vzeroupper\n";
+    }
+    // libm's float versions carry an f suffix
+    out << "    call " << function << (emitPrecision == PRECISION_SINGLE ? "f" : "");
+    if (!comment.empty()) {
+        out << "  ; " << comment;
+    }
+    out << "\n";
+}
+
+std::string Compiler::poolConstant(double value, const std::string& name) {
+    return poolConstant(value, name, emitPrecision == PRECISION_SINGLE);
+}
+
+std::string Compiler::poolConstant(double value, const std::string& name, bool single) {
+    // Key on the bit pattern so 0.0 and -0.0 stay distinct
+    uint64_t bits;
+    if (single) {
+        float rounded = static_cast<float>(value);
+        uint32_t floatBits;
+        std::memcpy(&floatBits, &rounded, sizeof(floatBits));
+        bits = floatBits;
+    } else {
+        std::memcpy(&bits, &value, sizeof(bits));
+    }
+    
+    std::pair<bool, uint64_t> key(single, bits);
+    auto entry = constantPool.find(key);
+    if (entry == constantPool.end()) {
+        entry = constantPool.insert(std::make_pair(key, static_cast<int>(constantOrder.size()))).first;
+        PoolEntry added;
+        added.bits = bits;
+        added.single = single;
+        added.name = name;
+        constantOrder.push_back(added);
+    }
+    return "[rel __const_" + std::to_string(entry->second) + "]";
+}
+
+std::string Compiler::scalar(const std::string& mnemonic) const {
+    if (emitPrecision != PRECISION_SINGLE) {
+        return mnemonic;
+    }
+    static const std::unordered_map<std::string, std::string> single = {
+        {"movsd", "movss"}, {"addsd", "addss"}, {"subsd", "subss"}, {"mulsd", "mulss"},
+        {"divsd", "divss"}, {"sqrtsd", "sqrtss"}, {"minsd", "minss"}, {"maxsd", "maxss"},
+        {"ucomisd", "ucomiss"}, {"cvttsd2si", "cvttss2si"}, {"cvtsi2sd", "cvtsi2ss"},
+        {"cmpltsd", "cmpltss"}, {"cmpneqsd", "cmpneqss"},
+        {"andpd", "andps"}, {"andnpd", "andnps"}, {"orpd", "orps"}, {"xorpd", "xorps"},
+        {"vfmadd231sd", "vfmadd231ss"}, {"vfnmadd231sd", "vfnmadd231ss"},
+        {"vfmadd213sd", "vfmadd213ss"}, {"vfmsub213sd", "vfmsub213ss"},
+        {"vblendvpd", "vblendvps"}
+    };
+    // Anything else, such as movq or cvtss2sd, is the same in both
+    auto found = single.find(mnemonic);
+    return found == single.end() ? mnemonic : found->second;
+}
+
+std::string Compiler::stackSlot(const std::string& index) const {
+    return std::string("[rbp + ") + (emitPrecision == PRECISION_SINGLE ? "4*" : "8*") + index + "]";
+}
+
+std::string Compiler::absMask() const {
+    return emitPrecision == PRECISION_SINGLE ? "[rel __m128_abs_mask]" : "[rel __m128d_abs_mask]";
+}
+
+bool Compiler::isLeaf(const Token& token) {
+    return token.isValue();
+}
+
+bool Compiler::isAddOrSub(const Token& token) const {
+    return operation(token) == OP_ADD || operation(token) == OP_SUB;
+}
+
+TargetFeatures detectHostFeatures() {
+    TargetFeatures features;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return features;
+    }
+    
+    // AVX is only usable when the OS saves YMM state (OSXSAVE + XCR0 bits 1 and 2)
+    bool osxsave = (ecx & (1u << 27)) != 0;
+    if (osxsave && (ecx & (1u << 28))) {
+        unsigned int xcr0Low, xcr0High;
+        __asm__("xgetbv" : "=a"(xcr0Low), "=d"(xcr0High) : "c"(0));
+        features.avx = (xcr0Low & 6) == 6;
+    }
+    features.fma = features.avx && (ecx & (1u << 12)) != 0;
+#endif
+    return features;
+}
+
+TargetFeatures targetFeaturesFor(const std::string& arch) {
+    TargetFeatures features;
+    if (arch == "native") {
+        return detectHostFeatures();
+    }
+    if (arch == "x86-64" || arch == "x86-64-v2") {
+        return features;
+    }
+    if (arch == "x86-64-v3" || arch == "haswell") {
+        features.avx = true;
+        features.fma = true;
+        return features;
+    }
+    throw std::runtime_error("Unknown target architecture: " + arch);
+}
@@ -1,9 +1,15 @@
 #ifndef COMPILER_H
 #define COMPILER_H
 
+#include <charconv>
+#include <cstdint>
+#include <ostream>
 #include <string>
+#include <type_traits>
 #include <vector>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <cmath>
 #include <stdexcept>
 #include <sstream>
@@ -15,32 +21,302 @@ public:
         OPERATOR,
         FUNCTION,
         CONSTANT,
-        STACK_OP
+        STACK_OP,
+        VARIABLE
     };
     
-    Token(Type type, const std::string& value) : type(type), strValue(value) {
+    Token(Type type, const std::string& value) : type(type), strValue(value), offset(-1) {
         if (type == NUMBER) {
             numValue = std::stod(value);
         }
     }
     
+    // Tokens that push a value without consuming any
+    bool isValue() const {
+        return type == NUMBER || type == CONSTANT || type == VARIABLE;
+    }
+    
     Type type;
     std::string strValue;
     double numValue;
+    
+    // Byte offset in the source expression of the word this token came from
+    // (for inlined definitions, the word that used the definition), or -1
+    // for tokens created by optimization passes
+    int offset;
+};
+
+// Built-in operations. The code generator and the interpreter switch on these
+// instead of comparing operator names.
+enum Operation {
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_POW,
+    OP_MOD,
+    OP_FACT,
+    OP_ABS,
+    OP_SIN,
+    OP_COS,
+    OP_TAN,
+    OP_SQRT,
+    OP_LN,
+    OP_LT,
+    OP_GT,
+    OP_MIN,
+    OP_MAX,
+    OP_SELECT,
+    OP_SWAP,
+    OP_DUP,
+    OPERATION_COUNT
+};
+
+// Entry of the operator table
+struct OperatorInfo {
+    // OPERATOR, FUNCTION or STACK_OP
+    Token::Type type;
+    Operation operation;
+    // Number of operands taken from the stack
+    int arity;
+};
+
+// Instruction set extensions the generated code may use
+struct TargetFeatures {
+    bool avx = false;
+    bool fma = false;
+};
+
+// Queries CPUID on the machine running the compiler (-march=native)
+TargetFeatures detectHostFeatures();
+
+// Features for a -march name: x86-64, x86-64-v2, x86-64-v3, haswell or native
+TargetFeatures targetFeaturesFor(const std::string& arch);
+
+// How the generated code handles invalid operations
+enum ErrorMode {
+    // Compare and branch before each operation, exit with a message
+    ERRORS_BRANCH,
+    // Let invalid operations produce NaN or infinity and check the result once
+    ERRORS_NAN_CHECKED,
+    // Let invalid operations produce NaN or infinity without any check
+    ERRORS_NAN
+};
+
+// Floating-point format of the generated code
+enum Precision {
+    // double constants, stack slots and arithmetic
+    PRECISION_DOUBLE,
+    // float constants, stack slots and arithmetic (ss instructions and the
+    // f versions of the libm functions); the result is printed as a double
+    PRECISION_SINGLE,
+    // float constants, converted on load; stack slots and arithmetic stay
+    // double so chains of operations accumulate in double
+    PRECISION_MIXED
+};
+
+struct CompileOptions {
+    TargetFeatures features;
+    Precision precision = PRECISION_DOUBLE;
+    
+    // In the NaN modes stack underflow is a compile-time error
+    ErrorMode errorMode = ERRORS_BRANCH;
+    
+    // Emit a baseline and an AVX/FMA version of the expression and
+    // pick one at startup with CPUID
+    bool multiversion = false;
+    
+    // Reference push_stack, pop_stack, the error handlers and their data
+    // from the runtime written by generateRuntime instead of emitting them
+    bool sharedRuntime = false;
+    
+    // Allow rewrites that change rounding, such as reassociating + and *
+    bool fastMath = false;
+    
+    // Apply the Simplifier's rewrite rules: only the exact ones unless
+    // fastMath is also set
+    bool simplify = false;
+    
+    // Emit NASM %line directives that map each token's code to its word in
+    // the source listing, so nasm -g puts token positions in the DWARF line table
+    bool debugLines = false;
+    
+    // Count how often each source word's code runs and the rdtsc cycles it
+    // takes, and print the counts before the program exits
+    bool profile = false;
+};
+
+// One whitespace-separated word of a source expression
+struct SourceWord {
+    size_t offset;
+    std::string text;
+};
+
+// Assembly text appended to a single string. The emitters write hundreds
+// of short pieces per expression; this skips the sentry, locale and
+// formatting state std::ostream handles for each of them. Integers are
+// written as operator<< would write them.
+class AssemblyBuffer {
+public:
+    AssemblyBuffer& operator<<(const std::string& piece) { text.append(piece); return *this; }
+    AssemblyBuffer& operator<<(const char* piece) { text.append(piece); return *this; }
+    AssemblyBuffer& operator<<(char c) { text.push_back(c); return *this; }
+    
+    template <typename T, typename = typename std::enable_if<std::is_integral<T>::value>::type>
+    AssemblyBuffer& operator<<(T value) {
+        char digits[24];
+        text.append(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr);
+        return *this;
+    }
+    
+    std::string text;
 };
 
 class Compiler {
 public:
     Compiler();
-    void compile(const std::string& expression, const std::string& outputFile);
+    
+    // Writes the assembly to outputFile, and the listing next to it with
+    // -g, and returns the assembly
+    std::string compile(const std::string& expression, const std::string& outputFile);
     std::string compileToString(const std::string& expression);
     
+    // Compiles tokens already produced by tokenize(expression), which must
+    // not be tokenized again once it has applied its definitions
+    std::string compile(const std::vector<Token>& tokens, const std::string& expression,
+                        const std::string& outputFile);
+    
+    // The assembly compile() would write to outputFile, without writing it.
+    // With -g, listing receives the listing for outputFile + ".rpn".
+    std::string compileToString(const std::string& expression, const std::string& outputFile,
+                                std::string& listing);
+    std::string compileToString(const std::vector<Token>& tokens, const std::string& expression,
+                                const std::string& outputFile, std::string& listing);
+    
     // Made public for direct testing
     std::vector<Token> tokenize(const std::string& expression);
+    std::vector<Token> optimize(const std::vector<Token>& tokens);
+    
+    // Simplifier rules that fired in the last optimize(), by rule
+    std::map<std::string, int> rewrites;
+    
+    void generateAssembly(const std::vector<Token>& tokens, AssemblyBuffer& out);
     void generateAssembly(const std::vector<Token>& tokens, std::ostream& out);
     
-    std::map<std::string, int> operatorArities;
+    // Standalone runtime for -shared-runtime output; assemble and link it once
+    void generateRuntime(AssemblyBuffer& out);
+    void generateRuntime(std::ostream& out);
+    
+    // Source expression for the %line directives and the profile report.
+    // compile() and compileToString() call this; listingName is the file
+    // the %line directives refer to.
+    void setSource(const std::string& expression, const std::string& listingName);
+    
+    // The listing the %line directives refer to: source word n on line n
+    void writeListing(std::ostream& out) const;
+    
+    static std::vector<SourceWord> splitWords(const std::string& expression);
+    
+    // Adds an operator to the table used by tokenize and the code generators
+    void defineOperator(const std::string& name, Token::Type type, Operation operation, int arity);
+    
+    // Forth-style definitions. Every use of a macro is replaced by its body
+    // in tokenize, so later passes see straight through it. A body is
+    // expanded when it is defined, so it may use earlier macros but not itself.
+    void defineMacro(const std::string& name, const std::vector<Token>& body);
+    
+    // Reads a file of ": name body ;" definitions
+    void loadLibrary(const std::string& path);
+    
+    // True for operators, functions, constants, variables and macros
+    bool isKnownWord(const std::string& word) const;
+    
+    std::unordered_map<std::string, OperatorInfo> operators;
+    std::unordered_map<std::string, std::vector<Token>> macros;
+    
+    // What an operator, function or stack token does, looked up in operators
+    // so passes see through names added by defineOperator. OPERATION_COUNT
+    // for other tokens and for names not in the table.
+    Operation operation(const Token& token) const;
     std::map<std::string, double> constants;
+    
+    // Input variables, mapped to their index in the input columns.
+    // Only the interpreter can evaluate expressions that use them.
+    std::map<std::string, int> variables;
+    CompileOptions options;
+    
+private:
+    // Capacity to reserve for the assembly of tokens
+    size_t assemblySize(const std::vector<Token>& tokens) const;
+    
+    void generateBody(const std::vector<Token>& tokens, AssemblyBuffer& out, int& labelCounter);
+    void emitRuntimeData(AssemblyBuffer& out, bool invalidResult);
+    void emitRuntimeHelpers(AssemblyBuffer& out, bool invalidResult);
+    void checkStackDepth(const std::vector<Token>& tokens);
+    static bool isNumber(const std::string& token);
+    
+    // Instruction emitters that follow emitFeatures
+    void emitLoad(AssemblyBuffer& out, const Token& token, const std::string& reg);
+    void emitOperandCheck(AssemblyBuffer& out, int count);
+    void emitZeroDivisorCheck(AssemblyBuffer& out);
+    void emitSSE(AssemblyBuffer& out, const std::string& mnemonic,
+                 const std::string& dst, const std::string& src,
+                 const std::string& comment = "");
+    void emitCall(AssemblyBuffer& out, const std::string& function, const std::string& comment = "");
+    
+    // Operand for the value of factorial and power errors
+    std::string errorValue();
+    
+    // The single-precision form of a double-precision mnemonic when
+    // generating single-precision code, otherwise the mnemonic itself
+    std::string scalar(const std::string& mnemonic) const;
+    
+    // Register stack slot addressed by an index register, and the abs mask
+    // operand, for the precision being generated
+    std::string stackSlot(const std::string& index) const;
+    std::string absMask() const;
+    
+    // Line of the token's word in the source listing, or 0 if it has none
+    int sourceLine(const Token& token) const;
+    
+    // Starts the code for token: its %line marker with -g and its profile
+    // timer. Returns the token's line and makes it previousLine.
+    int beginWord(AssemblyBuffer& out, const Token& token, int& previousLine);
+    void emitProfileStart(AssemblyBuffer& out, int line, bool countHit);
+    void emitProfileEnd(AssemblyBuffer& out, int line);
+    void emitProfileReport(AssemblyBuffer& out);
+    void emitProfileData(AssemblyBuffer& out);
+    
+    // Adds value to the constant pool and returns its RIP-relative operand.
+    // Without single, the width follows the precision being generated.
+    std::string poolConstant(double value, const std::string& name = "");
+    std::string poolConstant(double value, const std::string& name, bool single);
+    static bool isLeaf(const Token& token);
+    bool isAddOrSub(const Token& token) const;
+    
+    // Features and precision of the version currently being generated
+    TargetFeatures emitFeatures;
+    Precision emitPrecision = PRECISION_DOUBLE;
+    
+    struct PoolEntry {
+        uint64_t bits;
+        // Emitted as a float with dd
+        bool single;
+        // Source text the value came from
+        std::string name;
+    };
+    
+    // Constant pool of the program being generated: width and bit pattern
+    // to index, and the entries in index order
+    std::map<std::pair<bool, uint64_t>, int> constantPool;
+    std::vector<PoolEntry> constantOrder;
+    
+    // Set by setSource
+    std::vector<SourceWord> sourceWords;
+    std::string listingName;
+    
+    // Listing lines of the tokens in the program being generated
+    std::set<int> profiledLines;
 };
 
 #endif // COMPILER_H 
\ No newline at end of file
@@ -0,0 +1,208 @@
+#include "differentiator.h"
+#include "interpreter.h"
+
+Differentiator::Differentiator(const Compiler& compiler) : compiler(compiler) {
+}
+
+std::vector<ExprPtr> Differentiator::gradient(const ExprPtr& root, const std::vector<std::string>& variables) {
+    this->variables = variables;
+    tangents.clear();
+    
+    std::vector<ExprPtr> partials;
+    for (const ExprPtr& partial : tangent(root)) {
+        partials.push_back(orZero(partial));
+    }
+    return partials;
+}
+
+const Differentiator::Tangent& Differentiator::tangent(const ExprPtr& node) {
+    // A shared node is derived once, so its tangent is shared too
+    auto done = tangents.find(node.get());
+    if (done != tangents.end()) {
+        return done->second;
+    }
+    Tangent result = derive(node);
+    return tangents[node.get()] = result;
+}
+
+Differentiator::Tangent Differentiator::derive(const ExprPtr& node) {
+    Tangent result(variables.size());
+    const Token& token = node->token;
+    
+    if (token.type == Token::VARIABLE) {
+        for (size_t i = 0; i < variables.size(); i++) {
+            if (variables[i] == token.strValue) {
+                result[i] = ExpressionTree::number(1.0);
+            }
+        }
+        return result;
+    }
+    if (node->operands.empty()) {
+        return result;
+    }
+    
+    // References into the map stay valid while other nodes are added
+    std::vector<const Tangent*> d;
+    for (const ExprPtr& operand : node->operands) {
+        d.push_back(&tangent(operand));
+    }
+    const ExprPtr& a = node->operands[0];
+    const ExprPtr& b = node->operands.size() > 1 ? node->operands[1] : a;
+    ExprPtr zero = ExpressionTree::number(0.0);
+    ExprPtr one = ExpressionTree::number(1.0);
+    
+    // Factors are built once and shared by every partial; unused ones are
+    // never reached by the fuser
+    Operation operation = compiler.operators.at(token.strValue).operation;
+    switch (operation) {
+        case OP_ADD:
+            for (size_t i = 0; i < result.size(); i++) {
+                result[i] = add((*d[0])[i], (*d[1])[i]);
+            }
+            break;
+        case OP_SUB:
+            for (size_t i = 0; i < result.size(); i++) {
+                result[i] = subtract((*d[0])[i], (*d[1])[i]);
+            }
+            break;
+        case OP_MUL:
+            for (size_t i = 0; i < result.size(); i++) {
+                result[i] = add(scale(b, (*d[0])[i]), scale(a, (*d[1])[i]));
+            }
+            break;
+        case OP_DIV: {
+            // (a' - (a / b) b') / b, reusing the quotient
+            for (size_t i = 0; i < result.size(); i++) {
+                ExprPtr numerator = subtract((*d[0])[i], scale(node, (*d[1])[i]));
+                result[i] = numerator ? divide(numerator, b) : nullptr;
+            }
+            break;
+        }
+        case OP_POW: {
+            // y x^(y-1) x' + x^y ln(x) y'
+            ExprPtr exponent = b->token.type == Token::NUMBER ?
+                ExpressionTree::number(b->token.numValue - 1.0) : ExpressionTree::apply("-", b, one);
+            ExprPtr baseFactor = ExpressionTree::apply("*", b, ExpressionTree::apply("^", a, exponent));
+            ExprPtr exponentFactor = ExpressionTree::apply("*", node, call("ln", {a}));
+            for (size_t i = 0; i < result.size(); i++) {
+                result[i] = add(scale(baseFactor, (*d[0])[i]), scale(exponentFactor, (*d[1])[i]));
+            }
+            break;
+        }
+        case OP_MOD: {
+            // a - b floor(a / b), with floor(a / b) recovered as (a - a % b) / b
+            ExprPtr quotient = divide(ExpressionTree::apply("-", a, node), b);
+            for (size_t i = 0; i < result.size(); i++) {
+                result[i] = subtract((*d[0])[i], scale(quotient, (*d[1])[i]));
+            }
+            break;
+        }
+        case OP_ABS: {
+            // sign(a), which is 0 at 0
+            ExprPtr sign = ExpressionTree::apply("-", ExpressionTree::apply(">", a, zero),
+                                                 ExpressionTree::apply("<", a, zero));
+            for (size_t i = 0; i < result.size(); i++) {
+                result[i] = scale(sign, (*d[0])[i]);
+            }
+            break;
+        }
+        case OP_SIN: {
+            ExprPtr cosine = call("cos", {a});
+            for (size_t i = 0; i < result.size(); i++) {
+                result[i] = scale(cosine, (*d[0])[i]);
+            }
+            break;
+        }
+        case OP_COS: {
+            ExprPtr sine = call("sin", {a});
+            for (size_t i = 0; i < result.size(); i++) {
+                result[i] = subtract(nullptr, scale(sine, (*d[0])[i]));
+            }
+            break;
+        }
+        case OP_TAN: {
+            // 1 + tan^2, reusing the tangent
+            ExprPtr secant = ExpressionTree::apply("+", one, ExpressionTree::apply("*", node, node));
+            for (size_t i = 0; i < result.size(); i++) {
+                result[i] = scale(secant, (*d[0])[i]);
+            }
+            break;
+        }
+        case OP_SQRT: {
+            // a' / (2 sqrt(a)), reusing the root
+            ExprPtr twice = ExpressionTree::apply("*", ExpressionTree::number(2.0), node);
+            for (size_t i = 0; i < result.size(); i++) {
+                result[i] = (*d[0])[i] ? divide((*d[0])[i], twice) : nullptr;
+            }
+            break;
+        }
+        case OP_LN:
+            for (size_t i = 0; i < result.size(); i++) {
+                result[i] = (*d[0])[i] ? divide((*d[0])[i], a) : nullptr;
+            }
+            break;
+        case OP_MIN:
+        case OP_MAX:
+        case OP_SELECT: {
+            // The tangent of whichever operand is returned, chosen the same way
+            ExprPtr condition = node->operands.size() == 3 ? node->operands[2] :
+                ExpressionTree::apply(operation == OP_MIN ? "<" : ">", a, b);
+            for (size_t i = 0; i < result.size(); i++) {
+                if ((*d[0])[i] || (*d[1])[i]) {
+                    result[i] = call("select", {orZero((*d[0])[i]), orZero((*d[1])[i]), condition});
+                }
+            }
+            break;
+        }
+        default:
+            // Factorial and comparisons are constant between their steps
+            break;
+    }
+    return result;
+}
+
+ExprPtr Differentiator::call(const std::string& name, const std::vector<ExprPtr>& operands) const {
+    ExprPtr node = std::make_shared<ExprNode>(Token(compiler.operators.at(name).type, name));
+    node->operands = operands;
+    return node;
+}
+
+ExprPtr Differentiator::add(const ExprPtr& a, const ExprPtr& b) {
+    if (!a) {
+        return b;
+    }
+    if (!b) {
+        return a;
+    }
+    return ExpressionTree::apply("+", a, b);
+}
+
+ExprPtr Differentiator::subtract(const ExprPtr& a, const ExprPtr& b) {
+    if (!b) {
+        return a;
+    }
+    return ExpressionTree::apply("-", a ? a : ExpressionTree::number(0.0), b);
+}
+
+ExprPtr Differentiator::divide(const ExprPtr& a, const ExprPtr& b) {
+    // Derivatives are infinite or NaN where they do not exist, such as
+    // sqrt at 0, instead of failing the whole evaluation
+    return ExpressionTree::apply(Interpreter::IEEE_DIVIDE, a, b);
+}
+
+ExprPtr Differentiator::scale(const ExprPtr& factor, const ExprPtr& tangent) {
+    if (!tangent) {
+        return nullptr;
+    }
+    if (ExpressionTree::isNumber(tangent, 1.0)) {
+        return factor;
+    }
+    if (ExpressionTree::isNumber(factor, 1.0)) {
+        return tangent;
+    }
+    return ExpressionTree::apply("*", factor, tangent);
+}
+
+ExprPtr Differentiator::orZero(const ExprPtr& tangent) {
+    return tangent ? tangent : ExpressionTree::number(0.0);
+}
@@ -0,0 +1,50 @@
+#ifndef DIFFERENTIATOR_H
+#define DIFFERENTIATOR_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "compiler.h"
+#include "expression_tree.h"
+
+// Forward-mode automatic differentiation. Every node is treated as a dual
+// number: its value and one tangent per input variable, built in a single
+// walk over the expression. Tangents are expression trees that share nodes
+// with the original expression, so a KernelFuser computes the value and all
+// partial derivatives in one pass, reusing values such as sin(x) for cos.
+//
+// Derivatives follow the operators as they are evaluated: factorial,
+// comparisons and the floor in % are piecewise constant, abs uses the sign
+// of its operand, and min, max and select take the tangent of the operand
+// they return.
+class Differentiator {
+public:
+    explicit Differentiator(const Compiler& compiler);
+    
+    // Partial derivatives of root with respect to each of variables, in order
+    std::vector<ExprPtr> gradient(const ExprPtr& root, const std::vector<std::string>& variables);
+    
+private:
+    // Tangents indexed like variables; null means zero
+    typedef std::vector<ExprPtr> Tangent;
+    
+    const Tangent& tangent(const ExprPtr& node);
+    Tangent derive(const ExprPtr& node);
+    
+    ExprPtr call(const std::string& name, const std::vector<ExprPtr>& operands) const;
+    
+    // Arithmetic that folds the zeros and ones from constant operands
+    static ExprPtr add(const ExprPtr& a, const ExprPtr& b);
+    static ExprPtr subtract(const ExprPtr& a, const ExprPtr& b);
+    static ExprPtr scale(const ExprPtr& factor, const ExprPtr& tangent);
+    static ExprPtr orZero(const ExprPtr& tangent);
+    
+    // IEEE division, which never raises
+    static ExprPtr divide(const ExprPtr& a, const ExprPtr& b);
+    
+    const Compiler& compiler;
+    std::vector<std::string> variables;
+    std::map<const ExprNode*, Tangent> tangents;
+};
+
+#endif // DIFFERENTIATOR_H
@@ -0,0 +1,119 @@
+#include "expression_tree.h"
+#include <cstdio>
+
+bool ExpressionTree::build(const std::vector<Token>& tokens, const Compiler& compiler) {
+    std::vector<ExprPtr> stack;
+    
+    for (const Token& token : tokens) {
+        if (token.isValue()) {
+            stack.push_back(leaf(token));
+            continue;
+        }
+        
+        auto op = compiler.operators.find(token.strValue);
+        if (op == compiler.operators.end() ||
+            stack.size() < static_cast<size_t>(op->second.arity)) {
+            return false;
+        }
+        int arity = op->second.arity;
+        
+        if (op->second.operation == OP_SWAP) {
+            std::swap(stack[stack.size() - 1], stack[stack.size() - 2]);
+        }
+        else if (op->second.operation == OP_DUP) {
+            stack.push_back(stack.back());
+        }
+        else {
+            ExprPtr node = std::make_shared<ExprNode>(token);
+            node->operands.assign(stack.end() - arity, stack.end());
+            stack.resize(stack.size() - arity);
+            stack.push_back(node);
+        }
+    }
+    
+    roots = stack;
+    return true;
+}
+
+std::vector<Token> ExpressionTree::flatten() const {
+    std::vector<Token> out;
+    for (const ExprPtr& root : roots) {
+        emit(root, out);
+    }
+    return out;
+}
+
+void ExpressionTree::emit(const ExprPtr& node, std::vector<Token>& out) {
+    if (node->operands.size() == 2 && node->operands[0] == node->operands[1]) {
+        emit(node->operands[0], out);
+        out.push_back(Token(Token::STACK_OP, "dup"));
+    } else {
+        for (const ExprPtr& operand : node->operands) {
+            emit(operand, out);
+        }
+    }
+    out.push_back(node->token);
+}
+
+bool ExpressionTree::repeatsWork() const {
+    std::set<const ExprNode*> emitted;
+    for (const ExprPtr& root : roots) {
+        if (repeats(root, emitted)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ExpressionTree::repeats(const ExprPtr& node, std::set<const ExprNode*>& emitted) {
+    // Leaves are as cheap to push again as to dup
+    if (node->operands.empty()) {
+        return false;
+    }
+    if (!emitted.insert(node.get()).second) {
+        return true;
+    }
+    
+    // Follows emit(): an operand used twice by the same parent goes out once
+    if (node->operands.size() == 2 && node->operands[0] == node->operands[1]) {
+        return repeats(node->operands[0], emitted);
+    }
+    for (const ExprPtr& operand : node->operands) {
+        if (repeats(operand, emitted)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ExprPtr ExpressionTree::leaf(const Token& token) {
+    return std::make_shared<ExprNode>(token);
+}
+
+ExprPtr ExpressionTree::number(double value) {
+    // 17 significant digits round-trip exactly through std::stod
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.17g", value);
+    return leaf(Token(Token::NUMBER, buffer));
+}
+
+ExprPtr ExpressionTree::apply(const std::string& op, const ExprPtr& left, const ExprPtr& right) {
+    ExprPtr node = std::make_shared<ExprNode>(Token(Token::OPERATOR, op));
+    node->operands.push_back(left);
+    node->operands.push_back(right);
+    return node;
+}
+
+bool ExpressionTree::isNumber(const ExprPtr& node, double value) {
+    return node->token.type == Token::NUMBER && node->token.numValue == value;
+}
+
+bool ExpressionTree::sameLeaf(const ExprPtr& a, const ExprPtr& b) {
+    if (!a->operands.empty() || !b->operands.empty() || a->token.type != b->token.type) {
+        return false;
+    }
+    if (a->token.type == Token::NUMBER) {
+        return a->token.numValue == b->token.numValue;
+    }
+    return a->token.strValue == b->token.strValue;
+}
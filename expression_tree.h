@@ -0,0 +1,53 @@
+#ifndef EXPRESSION_TREE_H
+#define EXPRESSION_TREE_H
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include "compiler.h"
+
+struct ExprNode;
+typedef std::shared_ptr<ExprNode> ExprPtr;
+
+// One value in the expression: a leaf (number, constant or variable) or an operator
+// applied to its operands, first operand deepest on the RPN stack
+struct ExprNode {
+    explicit ExprNode(const Token& token) : token(token) {}
+    
+    Token token;
+    std::vector<ExprPtr> operands;
+};
+
+// Expression tree rebuilt from RPN tokens. swap only reorders the build
+// stack and dup shares one node between two uses, so the result is a DAG.
+class ExpressionTree {
+public:
+    // Returns false when the tokens would underflow the stack
+    bool build(const std::vector<Token>& tokens, const Compiler& compiler);
+    
+    // Back to RPN. A node used twice by the same parent is emitted once
+    // followed by dup; other shared nodes are emitted at every use.
+    std::vector<Token> flatten() const;
+    
+    // True when flatten() would emit some operator node more than once.
+    // Each repeat doubles the code below it, so callers keep their
+    // original tokens instead.
+    bool repeatsWork() const;
+    
+    static ExprPtr leaf(const Token& token);
+    static ExprPtr number(double value);
+    static ExprPtr apply(const std::string& op, const ExprPtr& left, const ExprPtr& right);
+    
+    static bool isNumber(const ExprPtr& node, double value);
+    static bool sameLeaf(const ExprPtr& a, const ExprPtr& b);
+    
+    // Values left on the stack, bottom first; the last one is the result
+    std::vector<ExprPtr> roots;
+    
+private:
+    static void emit(const ExprPtr& node, std::vector<Token>& out);
+    static bool repeats(const ExprPtr& node, std::set<const ExprNode*>& emitted);
+};
+
+#endif // EXPRESSION_TREE_H
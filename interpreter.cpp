@@ -0,0 +1,338 @@
+#include "interpreter.h"
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+
+// GCC and Clang support taking the address of a label, which lets every
+// handler jump directly to the next one. Other compilers use a switch loop.
+#if defined(__GNUC__)
+#define INTERPRETER_THREADED 1
+#endif
+
+namespace {
+
+// Largest double that cvttsd2si converts to a valid 64-bit integer
+const double INT64_LIMIT = 9223372036854775808.0;
+
+// x^y with the same rules as the generated code: non-negative integer
+// exponents use repeated squaring, everything else uses exp(y * ln(x)),
+// and a non-positive base in the general case gives 0
+double power(double x, double y) {
+    if (y > -INT64_LIMIT && y < INT64_LIMIT && y == std::trunc(y)) {
+        int64_t n = static_cast<int64_t>(y);
+        if (n == 0) {
+            return 1.0;
+        }
+        if (n > 0) {
+            double result = 1.0;
+            while (n) {
+                if (n & 1) {
+                    result *= x;
+                }
+                x *= x;
+                n >>= 1;
+            }
+            return result;
+        }
+    }
+    
+    // The generated code uses jbe here, so a NaN base is an error too
+    if (!(x > 0.0)) {
+        return 0.0;
+    }
+    return std::exp(y * std::log(x));
+}
+
+// n! for non-negative integers, 0 for anything else.
+// Values above 20 overflow 64 bits and are computed in floating point.
+double factorial(double x) {
+    if (!(x >= 0.0 && x < INT64_LIMIT && x == std::trunc(x))) {
+        return 0.0;
+    }
+    
+    int64_t n = static_cast<int64_t>(x);
+    if (n <= 20) {
+        int64_t result = 1;
+        for (int64_t i = 2; i <= n; i++) {
+            result *= i;
+        }
+        return static_cast<double>(result);
+    }
+    
+    double result = 1.0;
+    for (double i = x; i > 0.0; i -= 1.0) {
+        result *= i;
+    }
+    return result;
+}
+
+// ucomisd reports an unordered compare as equal, so the generated code
+// also treats a NaN divisor as division by zero
+bool isZeroDivisor(double y) {
+    return !(y < 0.0 || y > 0.0);
+}
+
+} // namespace
+
+const std::string Interpreter::IEEE_DIVIDE = "/ieee";
+
+Interpreter::Interpreter(const Compiler& compiler) : compiler(compiler) {
+    opcodes[OP_ADD] = Bytecode::ADD;
+    opcodes[OP_SUB] = Bytecode::SUB;
+    opcodes[OP_MUL] = Bytecode::MUL;
+    opcodes[OP_DIV] = Bytecode::DIV;
+    opcodes[OP_POW] = Bytecode::POW;
+    opcodes[OP_MOD] = Bytecode::MOD;
+    opcodes[OP_FACT] = Bytecode::FACT;
+    opcodes[OP_ABS] = Bytecode::ABS;
+    opcodes[OP_SIN] = Bytecode::SIN;
+    opcodes[OP_COS] = Bytecode::COS;
+    opcodes[OP_TAN] = Bytecode::TAN;
+    opcodes[OP_SQRT] = Bytecode::SQRT;
+    opcodes[OP_LN] = Bytecode::LN;
+    opcodes[OP_LT] = Bytecode::LT;
+    opcodes[OP_GT] = Bytecode::GT;
+    opcodes[OP_MIN] = Bytecode::MIN;
+    opcodes[OP_MAX] = Bytecode::MAX;
+    opcodes[OP_SELECT] = Bytecode::SELECT;
+    opcodes[OP_SWAP] = Bytecode::SWAP;
+    opcodes[OP_DUP] = Bytecode::DUP;
+    
+    handlers = nullptr;
+    run(nullptr, nullptr, &handlers);
+}
+
+Bytecode Interpreter::lower(const std::vector<Token>& tokens) const {
+    Bytecode program;
+    int depth = 0;
+    
+    for (const Token& token : tokens) {
+        if (token.type == Token::NUMBER) {
+            emit(program, Bytecode::PUSH, token.numValue);
+            depth++;
+        }
+        else if (token.type == Token::CONSTANT) {
+            emit(program, Bytecode::PUSH, compiler.constants.at(token.strValue));
+            depth++;
+        }
+        else if (token.type == Token::VARIABLE) {
+            emit(program, Bytecode::LOAD, 0.0, compiler.variables.at(token.strValue));
+            depth++;
+        }
+        else {
+            Bytecode::Opcode op = opcode(token.strValue);
+            
+            // The generated code checks this at runtime before every operator
+            int arity = compiler.operators.at(token.strValue).arity;
+            if (depth < arity) {
+                throw std::runtime_error("Stack underflow");
+            }
+            
+            emit(program, op);
+            if (op == Bytecode::DUP) {
+                depth++;
+            } else if (op != Bytecode::SWAP) {
+                depth -= arity - 1;
+            }
+        }
+        
+        if (depth > STACK_SIZE) {
+            throw std::runtime_error("Stack overflow");
+        }
+        if (depth > program.maxDepth) {
+            program.maxDepth = depth;
+        }
+    }
+    
+    // The final result is popped for printing
+    if (depth == 0) {
+        throw std::runtime_error("Stack underflow");
+    }
+    
+    emit(program, Bytecode::HALT);
+    return program;
+}
+
+double Interpreter::execute(const Bytecode& program) const {
+    return run(program.code.data(), nullptr, nullptr);
+}
+
+double Interpreter::execute(const Bytecode& program, const ExecutionContext& context) const {
+    return run(program.code.data(), &context, nullptr);
+}
+
+double Interpreter::evaluate(const std::vector<Token>& tokens) const {
+    return execute(lower(tokens));
+}
+
+Bytecode::Opcode Interpreter::opcode(const std::string& name) const {
+    if (name == IEEE_DIVIDE) {
+        return Bytecode::FDIV;
+    }
+    auto op = compiler.operators.find(name);
+    if (op == compiler.operators.end()) {
+        throw std::runtime_error("Unknown token: " + name);
+    }
+    return opcodes[op->second.operation];
+}
+
+void Interpreter::emit(Bytecode& program, Bytecode::Opcode opcode, double operand, int index) const {
+    Bytecode::Instruction instruction;
+    instruction.handler = handlers[opcode];
+    instruction.opcode = opcode;
+    instruction.operand = operand;
+    instruction.index = index;
+    program.code.push_back(instruction);
+}
+
+#ifdef INTERPRETER_THREADED
+#define HANDLER(op) op_##op:
+#define DISPATCH() goto *ip->handler;
+#define NEXT() ++ip; goto *ip->handler
+#else
+#define HANDLER(op) case Bytecode::op:
+#define DISPATCH() for (;;) switch (ip->opcode)
+#define NEXT() ++ip; continue
+#endif
+
+double Interpreter::run(const Bytecode::Instruction* ip, const ExecutionContext* context,
+                        const void* const** table) {
+#ifdef INTERPRETER_THREADED
+    // Indexed by Bytecode::Opcode
+    static const void* const dispatchTable[] = {
+        &&op_PUSH, &&op_LOAD, &&op_ADD, &&op_SUB, &&op_MUL, &&op_DIV, &&op_FDIV, &&op_POW,
+        &&op_MOD,
+        &&op_FACT, &&op_ABS, &&op_SIN, &&op_COS, &&op_TAN, &&op_SQRT, &&op_LN,
+        &&op_LT, &&op_GT, &&op_MIN, &&op_MAX, &&op_SELECT,
+        &&op_SWAP, &&op_DUP, &&op_FETCH, &&op_TEE, &&op_OUTPUT, &&op_HALT
+    };
+    if (table) {
+        *table = dispatchTable;
+        return 0.0;
+    }
+#else
+    static const void* const dispatchTable[Bytecode::HALT + 1] = {};
+    if (table) {
+        *table = dispatchTable;
+        return 0.0;
+    }
+#endif
+    
+    // sp points one past the top of the register stack
+    double stack[STACK_SIZE];
+    double* sp = stack;
+    double y;
+    
+    DISPATCH() {
+        HANDLER(PUSH)
+            *sp++ = ip->operand;
+            NEXT();
+        HANDLER(LOAD)
+            *sp++ = context->columns[ip->index][context->row];
+            NEXT();
+        HANDLER(ADD)
+            y = *--sp;
+            sp[-1] += y;
+            NEXT();
+        HANDLER(SUB)
+            y = *--sp;
+            sp[-1] -= y;
+            NEXT();
+        HANDLER(MUL)
+            y = *--sp;
+            sp[-1] *= y;
+            NEXT();
+        HANDLER(DIV)
+            y = *--sp;
+            if (isZeroDivisor(y)) {
+                throw std::runtime_error("Division by zero");
+            }
+            sp[-1] /= y;
+            NEXT();
+        HANDLER(FDIV)
+            y = *--sp;
+            sp[-1] /= y;
+            NEXT();
+        HANDLER(POW)
+            y = *--sp;
+            sp[-1] = power(sp[-1], y);
+            NEXT();
+        HANDLER(MOD)
+            y = *--sp;
+            if (isZeroDivisor(y)) {
+                throw std::runtime_error("Division by zero");
+            }
+            sp[-1] = sp[-1] - y * std::floor(sp[-1] / y);
+            NEXT();
+        HANDLER(FACT)
+            sp[-1] = factorial(sp[-1]);
+            NEXT();
+        HANDLER(ABS)
+            sp[-1] = std::fabs(sp[-1]);
+            NEXT();
+        HANDLER(SIN)
+            sp[-1] = std::sin(sp[-1]);
+            NEXT();
+        HANDLER(COS)
+            sp[-1] = std::cos(sp[-1]);
+            NEXT();
+        HANDLER(TAN)
+            sp[-1] = std::tan(sp[-1]);
+            NEXT();
+        HANDLER(SQRT)
+            sp[-1] = std::sqrt(sp[-1]);
+            NEXT();
+        HANDLER(LN)
+            sp[-1] = std::log(sp[-1]);
+            NEXT();
+        HANDLER(LT)
+            y = *--sp;
+            sp[-1] = sp[-1] < y ? 1.0 : 0.0;
+            NEXT();
+        HANDLER(GT)
+            y = *--sp;
+            sp[-1] = sp[-1] > y ? 1.0 : 0.0;
+            NEXT();
+        HANDLER(MIN)
+            // Same as minsd and maxsd: b when the operands are unordered
+            y = *--sp;
+            sp[-1] = sp[-1] < y ? sp[-1] : y;
+            NEXT();
+        HANDLER(MAX)
+            y = *--sp;
+            sp[-1] = sp[-1] > y ? sp[-1] : y;
+            NEXT();
+        HANDLER(SELECT)
+            // a b c select: a unless c is zero; a NaN c selects a
+            sp -= 2;
+            sp[-1] = sp[1] != 0.0 ? sp[-1] : sp[0];
+            NEXT();
+        HANDLER(SWAP)
+            y = sp[-1];
+            sp[-1] = sp[-2];
+            sp[-2] = y;
+            NEXT();
+        HANDLER(DUP)
+            *sp = sp[-1];
+            ++sp;
+            NEXT();
+        HANDLER(FETCH)
+            *sp++ = context->temps[ip->index];
+            NEXT();
+        HANDLER(TEE)
+            context->temps[ip->index] = sp[-1];
+            NEXT();
+        HANDLER(OUTPUT)
+            context->outputs[ip->index][context->row] = *--sp;
+            NEXT();
+        HANDLER(HALT)
+            // Kernels write their results with OUTPUT and leave nothing
+            return sp == stack ? 0.0 : sp[-1];
+    }
+    
+    return sp[-1];
+}
+
+#undef HANDLER
+#undef DISPATCH
+#undef NEXT
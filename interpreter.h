@@ -0,0 +1,107 @@
+#ifndef INTERPRETER_H
+#define INTERPRETER_H
+
+#include <string>
+#include <vector>
+#include "compiler.h"
+
+// Compact bytecode lowered from Compiler::tokenize output.
+// Each instruction carries the address of its handler, so the interpreter
+// jumps straight from one handler to the next (direct threading).
+class Bytecode {
+public:
+    enum Opcode {
+        PUSH,
+        LOAD,
+        ADD,
+        SUB,
+        MUL,
+        DIV,
+        // Division without the zero divisor check
+        FDIV,
+        POW,
+        MOD,
+        FACT,
+        ABS,
+        SIN,
+        COS,
+        TAN,
+        SQRT,
+        LN,
+        LT,
+        GT,
+        MIN,
+        MAX,
+        SELECT,
+        SWAP,
+        DUP,
+        FETCH,
+        TEE,
+        OUTPUT,
+        HALT
+    };
+    
+    struct Instruction {
+        const void* handler;
+        Opcode opcode;
+        double operand;
+        // Input column for LOAD, temporary for FETCH and TEE, output for OUTPUT
+        int index;
+    };
+    
+    std::vector<Instruction> code;
+    int maxDepth = 0;
+    
+    // Number of temporaries and output columns the program uses
+    int temps = 0;
+    int outputs = 0;
+};
+
+// Per-row state for programs that read columns or use FETCH, TEE and OUTPUT
+struct ExecutionContext {
+    const double* const* columns = nullptr;
+    double* const* outputs = nullptr;
+    double* temps = nullptr;
+    size_t row = 0;
+};
+
+// Evaluates expressions without generating assembly.
+// Results match the generated code: the same factorial and power rules,
+// floor modulus, and errors for division by zero and stack underflow.
+class Interpreter {
+public:
+    // Register stack size, matching the 32 doubles reserved by generateAssembly
+    static const int STACK_SIZE = 32;
+    
+    explicit Interpreter(const Compiler& compiler);
+    
+    // Stack depth is checked here, so execute() needs no underflow checks
+    Bytecode lower(const std::vector<Token>& tokens) const;
+    
+    // Variables are read from context.columns[index][row], with the index
+    // taken from Compiler::variables
+    double execute(const Bytecode& program) const;
+    double execute(const Bytecode& program, const ExecutionContext& context) const;
+    double evaluate(const std::vector<Token>& tokens) const;
+    
+    // Operator name for FDIV. It is not in Compiler::operators, so only
+    // trees built in code, such as derivatives, can use it.
+    static const std::string IEEE_DIVIDE;
+    
+    // Building blocks for other lowerings such as KernelFuser
+    Bytecode::Opcode opcode(const std::string& name) const;
+    void emit(Bytecode& program, Bytecode::Opcode opcode, double operand = 0.0, int index = 0) const;
+    
+private:
+    // Runs code starting at ip. When table is non-null, only returns the
+    // handler addresses (indexed by opcode) through it.
+    static double run(const Bytecode::Instruction* ip, const ExecutionContext* context,
+                      const void* const** table);
+    
+    const Compiler& compiler;
+    // Indexed by Operation
+    Bytecode::Opcode opcodes[OPERATION_COUNT];
+    const void* const* handlers;
+};
+
+#endif // INTERPRETER_H
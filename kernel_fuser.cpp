@@ -0,0 +1,156 @@
+#include "kernel_fuser.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+KernelFuser::KernelFuser(const Compiler& compiler, const Interpreter& interpreter)
+    : compiler(compiler), interpreter(interpreter) {
+}
+
+int KernelFuser::add(const std::vector<Token>& tokens) {
+    ExpressionTree tree;
+    if (!tree.build(tokens, compiler) || tree.roots.empty()) {
+        throw std::runtime_error("Stack underflow");
+    }
+    
+    // Only the value on top of the stack is a result
+    return add(std::vector<ExprPtr>(1, tree.roots.back())).front();
+}
+
+std::vector<int> KernelFuser::add(const std::vector<ExprPtr>& roots) {
+    // Nodes the roots share are only walked once
+    std::map<const ExprNode*, ExprPtr> done;
+    std::vector<int> indices;
+    for (const ExprPtr& root : roots) {
+        outputs.push_back(intern(root, done));
+        indices.push_back(static_cast<int>(outputs.size()) - 1);
+    }
+    return indices;
+}
+
+ExprPtr KernelFuser::intern(const ExprPtr& node, std::map<const ExprNode*, ExprPtr>& done) {
+    auto seen = done.find(node.get());
+    if (seen != done.end()) {
+        return seen->second;
+    }
+    
+    ExprPtr result = std::make_shared<ExprNode>(node->token);
+    for (const ExprPtr& operand : node->operands) {
+        result->operands.push_back(intern(operand, done));
+    }
+    
+    // a b + and b a + give the same double, so both become one node
+    Operation op = compiler.operation(result->token);
+    if (result->operands.size() == 2 && (op == OP_ADD || op == OP_MUL) &&
+        ids.at(result->operands[1].get()) < ids.at(result->operands[0].get())) {
+        std::swap(result->operands[0], result->operands[1]);
+    }
+    
+    std::string name = key(*result);
+    auto existing = nodes.find(name);
+    if (existing != nodes.end()) {
+        result = existing->second;
+    } else {
+        int id = static_cast<int>(ids.size());
+        nodes[name] = result;
+        ids[result.get()] = id;
+    }
+    
+    done[node.get()] = result;
+    return result;
+}
+
+std::string KernelFuser::key(const ExprNode& node) const {
+    const Token& token = node.token;
+    if (token.type == Token::NUMBER) {
+        // By bit pattern, so 0 and -0 stay apart
+        uint64_t bits;
+        std::memcpy(&bits, &token.numValue, sizeof(bits));
+        return "N:" + std::to_string(bits);
+    }
+    if (token.type == Token::CONSTANT) {
+        return "C:" + token.strValue;
+    }
+    if (token.type == Token::VARIABLE) {
+        return "V:" + token.strValue;
+    }
+    
+    // Names for the same operation share a key; names outside the operator
+    // table, such as Interpreter::IEEE_DIVIDE, keep their own
+    Operation op = compiler.operation(token);
+    std::string result = op == OPERATION_COUNT ? "O:" + token.strValue : "P:" + std::to_string(op);
+    for (const ExprPtr& operand : node.operands) {
+        result += ":" + std::to_string(ids.at(operand.get()));
+    }
+    return result;
+}
+
+Bytecode KernelFuser::build() {
+    std::map<const ExprNode*, int> uses;
+    for (const ExprPtr& output : outputs) {
+        countUses(output, uses);
+    }
+    
+    Bytecode program;
+    std::map<const ExprNode*, int> temps;
+    for (size_t i = 0; i < outputs.size(); i++) {
+        int depth = 0;
+        emit(outputs[i], program, uses, temps, depth);
+        interpreter.emit(program, Bytecode::OUTPUT, 0.0, static_cast<int>(i));
+    }
+    interpreter.emit(program, Bytecode::HALT);
+    
+    program.temps = static_cast<int>(temps.size());
+    program.outputs = static_cast<int>(outputs.size());
+    shared = program.temps;
+    return program;
+}
+
+void KernelFuser::countUses(const ExprPtr& node, std::map<const ExprNode*, int>& uses) const {
+    // Only walk a shared node's operands the first time it is reached
+    if (uses[node.get()]++ > 0) {
+        return;
+    }
+    for (const ExprPtr& operand : node->operands) {
+        countUses(operand, uses);
+    }
+}
+
+void KernelFuser::emit(const ExprPtr& node, Bytecode& program, const std::map<const ExprNode*, int>& uses,
+                       std::map<const ExprNode*, int>& temps, int& depth) const {
+    auto temp = temps.find(node.get());
+    if (temp != temps.end()) {
+        interpreter.emit(program, Bytecode::FETCH, 0.0, temp->second);
+    }
+    else if (node->token.type == Token::NUMBER) {
+        interpreter.emit(program, Bytecode::PUSH, node->token.numValue);
+    }
+    else if (node->token.type == Token::CONSTANT) {
+        interpreter.emit(program, Bytecode::PUSH, compiler.constants.at(node->token.strValue));
+    }
+    else {
+        if (node->token.type == Token::VARIABLE) {
+            interpreter.emit(program, Bytecode::LOAD, 0.0, compiler.variables.at(node->token.strValue));
+        } else {
+            for (const ExprPtr& operand : node->operands) {
+                emit(operand, program, uses, temps, depth);
+            }
+            interpreter.emit(program, interpreter.opcode(node->token.strValue));
+            depth -= static_cast<int>(node->operands.size());
+        }
+        
+        // Keep the value for its other uses; literals are cheaper to push again
+        if (uses.at(node.get()) > 1) {
+            int index = static_cast<int>(temps.size());
+            temps[node.get()] = index;
+            interpreter.emit(program, Bytecode::TEE, 0.0, index);
+        }
+    }
+    
+    depth++;
+    if (depth > Interpreter::STACK_SIZE) {
+        throw std::runtime_error("Stack overflow");
+    }
+    program.maxDepth = std::max(program.maxDepth, depth);
+}
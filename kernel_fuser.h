@@ -0,0 +1,51 @@
+#ifndef KERNEL_FUSER_H
+#define KERNEL_FUSER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "compiler.h"
+#include "expression_tree.h"
+#include "interpreter.h"
+
+// Fuses several expressions over the same input columns into one kernel.
+// Equal subexpressions are merged across all expressions (operands of + and *
+// in either order count as equal), every value used more than once is kept
+// in a temporary, and each input column is loaded once per row. The kernel
+// writes every output with OUTPUT, so one pass over the rows computes them all.
+class KernelFuser {
+public:
+    KernelFuser(const Compiler& compiler, const Interpreter& interpreter);
+    
+    // Returns the output column the expression's result is written to
+    int add(const std::vector<Token>& tokens);
+    
+    // Adds expression trees, such as derivatives from a Differentiator,
+    // returning their output columns in order
+    std::vector<int> add(const std::vector<ExprPtr>& roots);
+    
+    Bytecode build();
+    
+    // Values computed once and reused, after build()
+    int sharedValues() const { return shared; }
+    
+private:
+    ExprPtr intern(const ExprPtr& node, std::map<const ExprNode*, ExprPtr>& done);
+    std::string key(const ExprNode& node) const;
+    
+    void countUses(const ExprPtr& node, std::map<const ExprNode*, int>& uses) const;
+    void emit(const ExprPtr& node, Bytecode& program, const std::map<const ExprNode*, int>& uses,
+              std::map<const ExprNode*, int>& temps, int& depth) const;
+    
+    const Compiler& compiler;
+    const Interpreter& interpreter;
+    
+    // Every distinct node, by key, and the id used in parent keys
+    std::map<std::string, ExprPtr> nodes;
+    std::map<const ExprNode*, int> ids;
+    
+    std::vector<ExprPtr> outputs;
+    int shared = 0;
+};
+
+#endif // KERNEL_FUSER_H
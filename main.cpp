@@ -3,8 +3,18 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <cctype>
 #include <filesystem>
+#include <cstdio>
+#include <set>
+#include <sstream>
+#include <thread>
+#include "batch_pipeline.h"
+#include "column_evaluator.h"
 #include "compiler.h"
+#include "differentiator.h"
+#include "interpreter.h"
+#include "kernel_fuser.h"
 #include "natural_language.h"
 
 // Function to sanitize expression for use as filename
@@ -33,28 +43,46 @@ std::string sanitizeForFilename(const std::string& expression) {
 }
 
 // Function to determine if expression is in natural language
-bool isNaturalLanguage(const std::string& expression) {
-    // Check if the expression contains words instead of just symbols
-    for (size_t i = 0; i < expression.size(); i++) {
-        // Skip spaces
-        if (expression[i] == ' ') continue;
-        
-        // If we find alphabetic characters that are not 'e' or 'E' (scientific notation)
-        // and not function names (sin, cos, etc.), it's likely natural language
-        if (std::isalpha(expression[i]) && 
-            expression[i] != 'e' && expression[i] != 'E' &&
-            // Check for common functions
-            expression.substr(i, 3) != "sin" && 
-            expression.substr(i, 3) != "cos" && 
-            expression.substr(i, 3) != "tan" && 
-            expression.substr(i, 4) != "sqrt" &&
-            expression.substr(i, 3) != "abs" &&
-            expression.substr(i, 3) != "dup" &&
-            expression.substr(i, 4) != "swap" &&
-            // Check for constants
-            expression.substr(i, 2) != "pi" && 
-            expression.substr(i, 1) != "e") {
-            return true;
+bool isNaturalLanguage(const std::string& expression, const Compiler& compiler) {
+    std::istringstream words(expression);
+    std::string word;
+    
+    // Names defined with ": name ... ;" earlier in the same expression
+    std::set<std::string> defined;
+    bool definitionName = false;
+    
+    while (words >> word) {
+        if (definitionName) {
+            defined.insert(word);
+            definitionName = false;
+            continue;
+        }
+        if (word == ":") {
+            definitionName = true;
+            continue;
+        }
+        
+        // Words the compiler knows, such as functions, constants and macros
+        if (compiler.isKnownWord(word) || defined.count(word)) {
+            continue;
+        }
+        
+        // Numbers, including scientific notation like 1e5
+        size_t pos = 0;
+        try {
+            std::stod(word, &pos);
+        } catch (...) {
+            pos = 0;
+        }
+        if (pos == word.size()) {
+            continue;
+        }
+        
+        // Any other word with letters is likely natural language
+        for (char c : word) {
+            if (std::isalpha(static_cast<unsigned char>(c))) {
+                return true;
+            }
         }
     }
     
@@ -67,14 +95,400 @@ void printUsage() {
     std::cout << "  math-compiler                  (start in interactive mode)\n";
     std::cout << "  math-compiler <expression> [output_file]\n";
     std::cout << "  math-compiler -f <input_file> [output_file]\n";
+    std::cout << "  math-compiler -e <expression>  (evaluate without generating assembly, after -simplify and -ffast-math)\n";
+    std::cout << "  math-compiler -batch <input_file> <output_dir> [-threads=N]  (one .asm per line)\n";
+    std::cout << "  math-compiler -emit-runtime <output_file>  (write the shared runtime)\n";
+    std::cout << "  math-compiler -columns <expression> <output_file> <name>=<input_file>... [-threads=N]\n";
+    std::cout << "  math-compiler -fused <kernel_file> <name>=<input_file>... [-threads=N]\n";
+    std::cout << "  math-compiler -gradient <expression> <output_file> <name>=<input_file>... [-threads=N]\n";
+    std::cout << "Options:\n";
+    std::cout << "  -march=<arch>    target x86-64, x86-64-v2, x86-64-v3, haswell or native\n";
+    std::cout << "  -multiversion    emit SSE2 and AVX/FMA versions with a CPUID dispatcher\n";
+    std::cout << "  -ferror-mode=<m> branch (default), nan (check result once) or nan-unchecked\n";
+    std::cout << "  -precision=<p>   double (default), single, or mixed (float constants, double arithmetic)\n";
+    std::cout << "  -shared-runtime  reference helpers from the shared runtime instead of emitting them\n";
+    std::cout << "  -ffast-math      reassociate + and * chains and rewrite polynomials\n";
+    std::cout << "  -simplify        remove identities such as x 1 * (more with -ffast-math) and report them\n";
+    std::cout << "  -g               emit %line directives mapping code to a <output_file>.rpn listing\n";
+    std::cout << "  -profile         count executions and cycles per source word and print them at exit\n";
+    std::cout << "  -library=<file>  load \": name body ;\" definitions (may be repeated)\n";
     std::cout << "Examples:\n";
     std::cout << "  math-compiler \"3 4 +\"\n";
     std::cout << "  math-compiler \"pi 2 * sin\" output.asm\n";
     std::cout << "  math-compiler \"one plus two\" (natural language)\n";
     std::cout << "  math-compiler -f input.txt output.asm\n";
+    std::cout << "  math-compiler -e \"2 pi * sin\"\n";
+    std::cout << "  math-compiler -march=native \"3 4 * 5 +\"\n";
+    std::cout << "  math-compiler \": sq dup * ; 3 sq 4 sq +\"\n";
+    std::cout << "  math-compiler -columns \"x y * 2 +\" out.bin x=x.bin y=y.bin\n";
+    std::cout << "  math-compiler -fused features.txt x=x.bin y=y.bin\n";
+}
+
+// Remove compiler options from args and apply them to options.
+// Library files are collected separately for loadLibraries.
+void parseOptions(std::vector<char*>& args, CompileOptions& options, std::vector<std::string>& libraries) {
+    std::vector<char*> remaining;
+    
+    for (char* arg : args) {
+        std::string option = arg;
+        if (option.compare(0, 7, "-march=") == 0) {
+            options.features = targetFeaturesFor(option.substr(7));
+        }
+        else if (option == "-multiversion") {
+            options.multiversion = true;
+        }
+        else if (option.compare(0, 13, "-ferror-mode=") == 0) {
+            std::string mode = option.substr(13);
+            if (mode == "branch") {
+                options.errorMode = ERRORS_BRANCH;
+            } else if (mode == "nan") {
+                options.errorMode = ERRORS_NAN_CHECKED;
+            } else if (mode == "nan-unchecked") {
+                options.errorMode = ERRORS_NAN;
+            } else {
+                throw std::runtime_error("Unknown error mode: " + mode);
+            }
+        }
+        else if (option.compare(0, 11, "-precision=") == 0) {
+            std::string precision = option.substr(11);
+            if (precision == "double") {
+                options.precision = PRECISION_DOUBLE;
+            } else if (precision == "single") {
+                options.precision = PRECISION_SINGLE;
+            } else if (precision == "mixed") {
+                options.precision = PRECISION_MIXED;
+            } else {
+                throw std::runtime_error("Unknown precision: " + precision);
+            }
+        }
+        else if (option == "-shared-runtime") {
+            options.sharedRuntime = true;
+        }
+        else if (option == "-ffast-math") {
+            options.fastMath = true;
+        }
+        else if (option == "-simplify") {
+            options.simplify = true;
+        }
+        else if (option == "-g") {
+            options.debugLines = true;
+        }
+        else if (option == "-profile") {
+            options.profile = true;
+        }
+        else if (option.compare(0, 9, "-library=") == 0) {
+            libraries.push_back(option.substr(9));
+        }
+        else {
+            remaining.push_back(arg);
+        }
+    }
+    
+    args = remaining;
+}
+
+// Load definition libraries into the compiler, in command line order
+void loadLibraries(Compiler& compiler, const std::vector<std::string>& libraries) {
+    for (const std::string& library : libraries) {
+        compiler.loadLibrary(library);
+    }
+}
+
+// Evaluate an expression with the bytecode interpreter and print the result.
+// -simplify and -ffast-math rewrite it first, as they would for compilation.
+int evaluateMode(const std::string& expression, const CompileOptions& options,
+                 const std::vector<std::string>& libraries) {
+    Compiler compiler;
+    compiler.options = options;
+    Interpreter interpreter(compiler);
+    NaturalLanguageProcessor nlp;
+    
+    try {
+        loadLibraries(compiler, libraries);
+        
+        std::string rpnExpression = expression;
+        if (isNaturalLanguage(expression, compiler)) {
+            rpnExpression = nlp.convertToRPN(expression);
+        }
+        
+        double result = interpreter.evaluate(compiler.optimize(compiler.tokenize(rpnExpression)));
+        // Same format as the generated program's printf
+        std::printf("%lf\n", result);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    
+    return 0;
+}
+
+// Bind name=file arguments from args[first] on to compiler variables and
+// open the files, applying any -threads=N option
+std::vector<MappedColumn> bindColumns(const std::vector<std::string>& args, size_t first,
+                                      Compiler& compiler, unsigned& threads) {
+    std::vector<MappedColumn> columns;
+    for (size_t i = first; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        if (arg.compare(0, 9, "-threads=") == 0) {
+            threads = static_cast<unsigned>(std::stoul(arg.substr(9)));
+            continue;
+        }
+        
+        size_t equals = arg.find('=');
+        if (equals == std::string::npos || equals == 0) {
+            throw std::runtime_error("Expected <name>=<input_file>: " + arg);
+        }
+        std::string name = arg.substr(0, equals);
+        if (compiler.variables.count(name)) {
+            throw std::runtime_error("Column bound twice: " + name);
+        }
+        if (compiler.isKnownWord(name)) {
+            throw std::runtime_error("Column name is already in use: " + name);
+        }
+        compiler.variables[name] = static_cast<int>(columns.size());
+        columns.push_back(MappedColumn::openInput(arg.substr(equals + 1)));
+        
+        if (columns.back().rows() != columns.front().rows()) {
+            throw std::runtime_error("Column " + name + " has a different number of rows");
+        }
+    }
+    if (columns.empty()) {
+        throw std::runtime_error("At least one input column is needed");
+    }
+    return columns;
+}
+
+// Run a fused kernel over the bound columns, creating one output file per
+// expression
+void evaluateColumns(const Interpreter& interpreter, KernelFuser& fuser,
+                     const std::vector<MappedColumn>& columns, const std::vector<std::string>& outputFiles,
+                     unsigned threads) {
+    Bytecode program = fuser.build();
+    
+    std::vector<const double*> inputs;
+    for (const MappedColumn& column : columns) {
+        inputs.push_back(column.data());
+    }
+    size_t rows = columns.front().rows();
+    
+    std::vector<MappedColumn> outputColumns;
+    std::vector<double*> outputs;
+    for (const std::string& file : outputFiles) {
+        outputColumns.push_back(MappedColumn::createOutput(file, rows));
+        outputs.push_back(outputColumns.back().data());
+    }
+    
+    ColumnEvaluator evaluator(interpreter);
+    evaluator.run(program, inputs, outputs, rows, threads);
+    
+    // Only a complete run replaces the output files
+    for (MappedColumn& column : outputColumns) {
+        column.commit();
+    }
+}
+
+// Evaluate an expression over memory-mapped column files of doubles.
+// args: expression, output file, then name=file bindings and -threads=N
+int columnsMode(const std::vector<std::string>& args, const std::vector<std::string>& libraries) {
+    Compiler compiler;
+    Interpreter interpreter(compiler);
+    KernelFuser fuser(compiler, interpreter);
+    
+    try {
+        if (args.size() < 3) {
+            throw std::runtime_error("-columns needs an expression, an output file and at least one input column");
+        }
+        
+        loadLibraries(compiler, libraries);
+        unsigned threads = std::thread::hardware_concurrency();
+        std::vector<MappedColumn> columns = bindColumns(args, 2, compiler, threads);
+        
+        // Variable names look like natural language, so no conversion here
+        fuser.add(compiler.tokenize(args[0]));
+        evaluateColumns(interpreter, fuser, columns, std::vector<std::string>(1, args[1]), threads);
+        std::cout << "Evaluated " << columns.front().rows() << " rows into " << args[1] << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    
+    return 0;
+}
+
+// File for the partial derivative by name next to the value file:
+// out.bin becomes out.dx.bin for x
+std::string partialFile(const std::string& file, const std::string& name) {
+    std::filesystem::path path(file);
+    std::string extension = path.extension().string();
+    path.replace_extension();
+    return path.string() + ".d" + name + extension;
+}
+
+// Evaluate an expression and its partial derivative with respect to every
+// input column in one pass over the column files.
+// args: expression, output file, then name=file bindings and -threads=N
+int gradientMode(const std::vector<std::string>& args, const std::vector<std::string>& libraries) {
+    Compiler compiler;
+    Interpreter interpreter(compiler);
+    KernelFuser fuser(compiler, interpreter);
+    Differentiator differentiator(compiler);
+    
+    try {
+        if (args.size() < 3) {
+            throw std::runtime_error("-gradient needs an expression, an output file and at least one input column");
+        }
+        
+        loadLibraries(compiler, libraries);
+        unsigned threads = std::thread::hardware_concurrency();
+        std::vector<MappedColumn> columns = bindColumns(args, 2, compiler, threads);
+        
+        ExpressionTree tree;
+        if (!tree.build(compiler.tokenize(args[0]), compiler) || tree.roots.empty()) {
+            throw std::runtime_error("Stack underflow");
+        }
+        
+        // Partials in column order
+        std::vector<std::string> names(columns.size());
+        for (const auto& variable : compiler.variables) {
+            names[variable.second] = variable.first;
+        }
+        
+        std::vector<ExprPtr> roots(1, tree.roots.back());
+        std::vector<std::string> outputFiles(1, args[1]);
+        for (size_t i = 0; i < names.size(); i++) {
+            outputFiles.push_back(partialFile(args[1], names[i]));
+        }
+        std::vector<ExprPtr> partials = differentiator.gradient(roots.front(), names);
+        roots.insert(roots.end(), partials.begin(), partials.end());
+        fuser.add(roots);
+        
+        evaluateColumns(interpreter, fuser, columns, outputFiles, threads);
+        std::cout << "Evaluated " << columns.front().rows() << " rows into " << args[1] << " and "
+                  << names.size() << " partial derivatives" << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    
+    return 0;
+}
+
+// Evaluate every "<output_file> = <expression>" line of a kernel file in one
+// pass over the column files.
+// args: kernel file, then name=file bindings and -threads=N
+int fusedMode(const std::vector<std::string>& args, const std::vector<std::string>& libraries) {
+    Compiler compiler;
+    Interpreter interpreter(compiler);
+    KernelFuser fuser(compiler, interpreter);
+    
+    try {
+        if (args.size() < 2) {
+            throw std::runtime_error("-fused needs a kernel file and at least one input column");
+        }
+        
+        loadLibraries(compiler, libraries);
+        unsigned threads = std::thread::hardware_concurrency();
+        std::vector<MappedColumn> columns = bindColumns(args, 1, compiler, threads);
+        
+        std::ifstream kernelFile(args[0]);
+        if (!kernelFile) {
+            throw std::runtime_error("Could not open kernel file: " + args[0]);
+        }
+        
+        std::vector<std::string> outputFiles;
+        std::string line;
+        int lineNumber = 0;
+        while (std::getline(kernelFile, line)) {
+            lineNumber++;
+            size_t first = line.find_first_not_of(" \t\r");
+            if (first == std::string::npos || line[first] == '#') {
+                continue;
+            }
+            
+            size_t equals = line.find('=');
+            if (equals == std::string::npos) {
+                throw std::runtime_error("Line " + std::to_string(lineNumber) + ": expected <output_file> = <expression>");
+            }
+            std::string file = line.substr(first, equals - first);
+            file.erase(file.find_last_not_of(" \t") + 1);
+            if (file.empty() || equals == first) {
+                throw std::runtime_error("Line " + std::to_string(lineNumber) + ": missing output file");
+            }
+            
+            try {
+                fuser.add(compiler.tokenize(line.substr(equals + 1)));
+            } catch (const std::exception& e) {
+                throw std::runtime_error("Line " + std::to_string(lineNumber) + ": " + e.what());
+            }
+            outputFiles.push_back(file);
+        }
+        if (outputFiles.empty()) {
+            throw std::runtime_error("No expressions in kernel file: " + args[0]);
+        }
+        
+        evaluateColumns(interpreter, fuser, columns, outputFiles, threads);
+        std::cout << "Evaluated " << outputFiles.size() << " expressions over " << columns.front().rows()
+                  << " rows, " << fuser.sharedValues() << " values shared" << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    
+    return 0;
+}
+
+// Natural language is converted to RPN; RPN is returned unchanged
+std::string toRPN(const std::string& expression, const Compiler& compiler) {
+    if (!isNaturalLanguage(expression, compiler)) {
+        return expression;
+    }
+    NaturalLanguageProcessor nlp;
+    return nlp.convertToRPN(expression);
 }
 
-void interactiveMode() {
+// Compile every line of a file to its own assembly file, reading, compiling
+// and writing at the same time.
+// args: input file, output directory, then -threads=N
+int batchMode(const std::vector<std::string>& args, const CompileOptions& options,
+              const std::vector<std::string>& libraries) {
+    Compiler compiler;
+    compiler.options = options;
+    
+    try {
+        if (args.size() < 2) {
+            throw std::runtime_error("-batch needs an input file and an output directory");
+        }
+        
+        unsigned threads = std::thread::hardware_concurrency();
+        for (size_t i = 2; i < args.size(); i++) {
+            if (args[i].compare(0, 9, "-threads=") != 0) {
+                throw std::runtime_error("Unexpected argument: " + args[i]);
+            }
+            threads = static_cast<unsigned>(std::stoul(args[i].substr(9)));
+        }
+        
+        // Workers copy the compiler, so libraries are read once
+        loadLibraries(compiler, libraries);
+        BatchPipeline pipeline(compiler, toRPN);
+        int failures = pipeline.run(args[0], args[1], threads);
+        std::cout << "Compiled " << pipeline.compiled() - failures << " of " << pipeline.compiled()
+                  << " expressions into " << args[1] << std::endl;
+        return failures ? 1 : 0;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
+
+// List the simplifier rules that fired in the last compilation
+void printRewrites(const Compiler& compiler) {
+    for (const auto& rewrite : compiler.rewrites) {
+        std::cout << "Simplified " << rewrite.first << " (" << rewrite.second
+                  << (rewrite.second == 1 ? " time)" : " times)") << std::endl;
+    }
+}
+
+void interactiveMode(const CompileOptions& options, const std::vector<std::string>& libraries) {
     std::cout << "Math Compiler Interactive Mode\n";
     std::cout << "==============================\n";
     std::cout << "Enter RPN expressions or natural language to convert to assembly.\n";
@@ -82,10 +496,18 @@ void interactiveMode() {
     std::cout << "  3 4 +         (RPN for 3 + 4)\n";
     std::cout << "  pi 2 * sin    (RPN for sin(pi * 2))\n";
     std::cout << "  one plus two  (natural language)\n";
+    std::cout << "  : sq dup * ;  (define sq for later expressions)\n";
     std::cout << "Enter 'exit' to quit.\n\n";
     
     Compiler compiler;
+    compiler.options = options;
     NaturalLanguageProcessor nlp;
+    try {
+        loadLibraries(compiler, libraries);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return;
+    }
     std::string expression;
     
     // Ensure output directory exists
@@ -106,24 +528,31 @@ void interactiveMode() {
         try {
             // Check if it's natural language and convert if needed
             std::string rpnExpression = expression;
-            if (isNaturalLanguage(expression)) {
+            if (isNaturalLanguage(expression, compiler)) {
                 rpnExpression = nlp.convertToRPN(expression);
                 std::cout << "Converted to RPN: " << rpnExpression << std::endl;
             }
             
+            // Tokenized once: tokenizing again would apply its definitions twice
+            std::vector<Token> tokens = compiler.tokenize(rpnExpression);
+            
+            // A line of definitions only has nothing to compile
+            if (tokens.empty()) {
+                std::cout << "Defined." << std::endl << std::endl;
+                continue;
+            }
+            
             // Create output filename based on expression
             std::string outputFile = "output/" + sanitizeForFilename(expression);
             
-            // First get the assembly as a string
-            std::string assembly = compiler.compileToString(rpnExpression);
+            // Compile once, saving the file and keeping the text to display
+            std::string assembly = compiler.compile(tokens, rpnExpression, outputFile);
+            printRewrites(compiler);
             
             // Display the assembly
             std::cout << "\n===== GENERATED ASSEMBLY =====\n";
             std::cout << assembly;
             std::cout << "==============================\n\n";
-            
-            // Also save to file
-            compiler.compile(rpnExpression, outputFile);
             std::cout << "Assembly saved to " << outputFile << std::endl;
         } catch (const std::exception& e) {
             std::cerr << "Compilation error: " << e.what() << std::endl;
@@ -133,11 +562,55 @@ void interactiveMode() {
 }
 
 int main(int argc, char* argv[]) {
+    std::vector<char*> args(argv, argv + argc);
+    CompileOptions options;
+    std::vector<std::string> libraries;
+    try {
+        parseOptions(args, options, libraries);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    argc = static_cast<int>(args.size());
+    argv = args.data();
+    
+    if (argc >= 3 && std::string(argv[1]) == "-e") {
+        return evaluateMode(argv[2], options, libraries);
+    }
+    
+    if (argc >= 2 && std::string(argv[1]) == "-columns") {
+        return columnsMode(std::vector<std::string>(argv + 2, argv + argc), libraries);
+    }
+    
+    if (argc >= 2 && std::string(argv[1]) == "-gradient") {
+        return gradientMode(std::vector<std::string>(argv + 2, argv + argc), libraries);
+    }
+    
+    if (argc >= 2 && std::string(argv[1]) == "-batch") {
+        return batchMode(std::vector<std::string>(argv + 2, argv + argc), options, libraries);
+    }
+    
+    if (argc >= 2 && std::string(argv[1]) == "-fused") {
+        return fusedMode(std::vector<std::string>(argv + 2, argv + argc), libraries);
+    }
+    
+    if (argc >= 3 && std::string(argv[1]) == "-emit-runtime") {
+        std::ofstream outFile(argv[2]);
+        if (!outFile) {
+            std::cerr << "Error: Could not open output file: " << argv[2] << std::endl;
+            return 1;
+        }
+        Compiler compiler;
+        compiler.generateRuntime(outFile);
+        std::cout << "Runtime saved to " << argv[2] << std::endl;
+        return 0;
+    }
+    
     // Ensure output directory exists
     std::filesystem::create_directories("output");
     
     if (argc < 2) {
-        interactiveMode();
+        interactiveMode(options, libraries);
         return 0;
     }
 
@@ -180,25 +653,27 @@ int main(int argc, char* argv[]) {
     }
 
     Compiler compiler;
+    compiler.options = options;
     NaturalLanguageProcessor nlp;
     
     try {
+        loadLibraries(compiler, libraries);
+        
         // Check if it's natural language and convert if needed
         std::string rpnExpression = expression;
-        if (isNaturalLanguage(expression)) {
+        if (isNaturalLanguage(expression, compiler)) {
             rpnExpression = nlp.convertToRPN(expression);
             std::cout << "Converted to RPN: " << rpnExpression << std::endl;
         }
         
         // If using command line mode, also show the assembly
-        std::string assembly = compiler.compileToString(rpnExpression);
+        std::string assembly = compiler.compile(rpnExpression, outputFile);
+        printRewrites(compiler);
         
         // Display the assembly
         std::cout << "\n===== GENERATED ASSEMBLY =====\n";
         std::cout << assembly;
         std::cout << "==============================\n\n";
-        
-        compiler.compile(rpnExpression, outputFile);
         std::cout << "Assembly saved to " << outputFile << std::endl;
     } catch (const std::exception& e) {
         std::cerr << "Compilation error: " << e.what() << std::endl;
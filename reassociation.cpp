@@ -0,0 +1,308 @@
+#include "reassociation.h"
+#include <cmath>
+
+namespace {
+
+// Highest power rewritten into a polynomial
+const int MAX_DEGREE = 32;
+
+} // namespace
+
+Reassociator::Reassociator(const Compiler& compiler) : compiler(compiler) {
+}
+
+bool Reassociator::isOperator(const ExprPtr& node, Operation operation) const {
+    return compiler.operation(node->token) == operation;
+}
+
+std::vector<Token> Reassociator::run(const std::vector<Token>& tokens) {
+    ExpressionTree tree;
+    if (!tree.build(tokens, compiler)) {
+        return tokens;
+    }
+    
+    uses.clear();
+    rewritten.clear();
+    for (const ExprPtr& root : tree.roots) {
+        countUses(root);
+    }
+    for (ExprPtr& root : tree.roots) {
+        root = rewrite(root);
+    }
+    
+    // A value shared through dup and swap would be recomputed at every use
+    if (tree.repeatsWork()) {
+        return tokens;
+    }
+    return tree.flatten();
+}
+
+void Reassociator::countUses(const ExprPtr& node) {
+    // Only walk a shared node's operands the first time it is reached
+    if (uses[node.get()]++ > 0) {
+        return;
+    }
+    for (const ExprPtr& operand : node->operands) {
+        countUses(operand);
+    }
+}
+
+ExprPtr Reassociator::rewrite(const ExprPtr& node) {
+    auto done = rewritten.find(node.get());
+    if (done != rewritten.end()) {
+        return done->second;
+    }
+    
+    ExprPtr result;
+    if (node->operands.empty()) {
+        result = node;
+    }
+    else if (isOperator(node, OP_ADD) || isOperator(node, OP_SUB)) {
+        std::vector<Term> terms;
+        collectTerms(node, false, terms);
+        for (Term& term : terms) {
+            term.node = rewrite(term.node);
+        }
+        result = sum(terms);
+    }
+    else if (isOperator(node, OP_MUL)) {
+        std::vector<ExprPtr> factors;
+        collectFactors(node, factors);
+        for (ExprPtr& factor : factors) {
+            factor = rewrite(factor);
+        }
+        result = balance("*", factors, 0, factors.size());
+    }
+    else {
+        result = std::make_shared<ExprNode>(node->token);
+        for (const ExprPtr& operand : node->operands) {
+            result->operands.push_back(rewrite(operand));
+        }
+    }
+    
+    rewritten[node.get()] = result;
+    return result;
+}
+
+void Reassociator::collectTerms(const ExprPtr& node, bool negative, std::vector<Term>& terms) {
+    bool subtract = isOperator(node, OP_SUB);
+    for (size_t i = 0; i < node->operands.size(); i++) {
+        const ExprPtr& operand = node->operands[i];
+        bool operandNegative = (subtract && i == 1) ? !negative : negative;
+        
+        // Shared nodes stay intact so they are still computed once
+        if ((isOperator(operand, OP_ADD) || isOperator(operand, OP_SUB)) && uses[operand.get()] == 1) {
+            collectTerms(operand, operandNegative, terms);
+        } else {
+            Term term = { operand, operandNegative };
+            terms.push_back(term);
+        }
+    }
+}
+
+void Reassociator::collectFactors(const ExprPtr& node, std::vector<ExprPtr>& factors) {
+    for (const ExprPtr& operand : node->operands) {
+        if (isOperator(operand, OP_MUL) && uses[operand.get()] == 1) {
+            collectFactors(operand, factors);
+        } else {
+            factors.push_back(operand);
+        }
+    }
+}
+
+ExprPtr Reassociator::sum(std::vector<Term>& terms) {
+    std::vector<ExprPtr> positive;
+    std::vector<ExprPtr> negative;
+    
+    ExprPtr polynomial = extractPolynomial(terms);
+    if (polynomial) {
+        positive.push_back(polynomial);
+    }
+    for (const Term& term : terms) {
+        (term.negative ? negative : positive).push_back(term.node);
+    }
+    
+    // The leftmost term of a chain is never negated, so positive is not
+    // empty unless the polynomial took every term
+    ExprPtr result = balance("+", positive, 0, positive.size());
+    if (!negative.empty()) {
+        result = ExpressionTree::apply("-", result, balance("+", negative, 0, negative.size()));
+    }
+    return result;
+}
+
+ExprPtr Reassociator::extractPolynomial(std::vector<Term>& terms) {
+    ExprPtr variable = findVariable(terms);
+    if (!variable) {
+        return nullptr;
+    }
+    
+    std::vector<ExprPtr> coefficients;
+    std::vector<Term> remaining;
+    int matched = 0;
+    
+    for (const Term& term : terms) {
+        ExprPtr coefficient;
+        int degree;
+        if (!matchTerm(term.node, variable, coefficient, degree)) {
+            remaining.push_back(term);
+            continue;
+        }
+        
+        if (term.negative) {
+            if (coefficient->token.type == Token::NUMBER) {
+                coefficient = ExpressionTree::number(-coefficient->token.numValue);
+            } else {
+                coefficient = ExpressionTree::apply("-", ExpressionTree::number(0.0), coefficient);
+            }
+        }
+        
+        if (coefficients.size() <= static_cast<size_t>(degree)) {
+            coefficients.resize(degree + 1);
+        }
+        ExprPtr& slot = coefficients[degree];
+        slot = slot ? ExpressionTree::apply("+", slot, coefficient) : coefficient;
+        matched++;
+    }
+    
+    if (matched < 2) {
+        return nullptr;
+    }
+    
+    terms = remaining;
+    size_t degree = coefficients.size() - 1;
+    if (degree <= 3) {
+        return horner(coefficients, variable);
+    }
+    return estrin(coefficients, 0, coefficients.size(), variable);
+}
+
+ExprPtr Reassociator::findVariable(const std::vector<Term>& terms) const {
+    // The variable is the leaf base of the first power term x^k with k >= 2
+    for (const Term& term : terms) {
+        const ExprPtr& node = term.node;
+        std::vector<ExprPtr> candidates;
+        candidates.push_back(node);
+        if (isOperator(node, OP_MUL)) {
+            candidates.push_back(node->operands[0]);
+            candidates.push_back(node->operands[1]);
+        }
+        
+        for (const ExprPtr& candidate : candidates) {
+            int degree;
+            if (isOperator(candidate, OP_POW) && candidate->operands[0]->operands.empty() &&
+                matchPower(candidate, candidate->operands[0], degree) && degree >= 2) {
+                return candidate->operands[0];
+            }
+        }
+    }
+    return nullptr;
+}
+
+bool Reassociator::matchPower(const ExprPtr& node, const ExprPtr& variable, int& degree) const {
+    if (ExpressionTree::sameLeaf(node, variable)) {
+        degree = 1;
+        return true;
+    }
+    if (!isOperator(node, OP_POW) || !ExpressionTree::sameLeaf(node->operands[0], variable)) {
+        return false;
+    }
+    
+    const Token& exponent = node->operands[1]->token;
+    if (exponent.type != Token::NUMBER || exponent.numValue != std::floor(exponent.numValue) ||
+        exponent.numValue < 0 || exponent.numValue > MAX_DEGREE) {
+        return false;
+    }
+    degree = static_cast<int>(exponent.numValue);
+    return true;
+}
+
+bool Reassociator::matchTerm(const ExprPtr& node, const ExprPtr& variable, ExprPtr& coefficient, int& degree) const {
+    if (matchPower(node, variable, degree)) {
+        coefficient = ExpressionTree::number(1.0);
+        return true;
+    }
+    
+    // c * x^k or x^k * c with a leaf coefficient
+    if (isOperator(node, OP_MUL)) {
+        for (int i = 0; i < 2; i++) {
+            const ExprPtr& factor = node->operands[i];
+            const ExprPtr& other = node->operands[1 - i];
+            if (other->operands.empty() && !ExpressionTree::sameLeaf(other, variable) &&
+                matchPower(factor, variable, degree)) {
+                coefficient = other;
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // A leaf other than the variable is a constant term
+    if (node->operands.empty()) {
+        coefficient = node;
+        degree = 0;
+        return true;
+    }
+    return false;
+}
+
+ExprPtr Reassociator::horner(const std::vector<ExprPtr>& coefficients, const ExprPtr& x) {
+    ExprPtr result = coefficients.back();
+    for (size_t degree = coefficients.size() - 1; degree-- > 0; ) {
+        result = multiply(result, x);
+        if (coefficients[degree]) {
+            result = ExpressionTree::apply("+", result, coefficients[degree]);
+        }
+    }
+    return result;
+}
+
+ExprPtr Reassociator::estrin(const std::vector<ExprPtr>& coefficients, size_t begin, size_t end, const ExprPtr& x) {
+    size_t count = end - begin;
+    if (count <= 2) {
+        ExprPtr result = coefficients[begin];
+        if (count == 2 && coefficients[begin + 1]) {
+            ExprPtr term = multiply(coefficients[begin + 1], x);
+            result = result ? ExpressionTree::apply("+", result, term) : term;
+        }
+        return result;
+    }
+    
+    // p(x) = low(x) + x^half * high(x), with both halves independent
+    size_t half = 1;
+    while (half * 2 < count) {
+        half *= 2;
+    }
+    ExprPtr low = estrin(coefficients, begin, begin + half, x);
+    ExprPtr high = estrin(coefficients, begin + half, end, x);
+    if (!high) {
+        return low;
+    }
+    
+    ExprPtr term = multiply(high, power(x, half));
+    return low ? ExpressionTree::apply("+", low, term) : term;
+}
+
+ExprPtr Reassociator::power(const ExprPtr& x, size_t exponent) {
+    if (exponent == 1) {
+        return x;
+    }
+    // Squaring a shared node flattens to "dup *"
+    ExprPtr root = power(x, exponent / 2);
+    return ExpressionTree::apply("*", root, root);
+}
+
+ExprPtr Reassociator::multiply(const ExprPtr& a, const ExprPtr& b) {
+    if (ExpressionTree::isNumber(a, 1.0)) {
+        return b;
+    }
+    return ExpressionTree::apply("*", a, b);
+}
+
+ExprPtr Reassociator::balance(const std::string& op, const std::vector<ExprPtr>& operands, size_t begin, size_t end) {
+    if (end - begin == 1) {
+        return operands[begin];
+    }
+    size_t middle = begin + (end - begin) / 2;
+    return ExpressionTree::apply(op, balance(op, operands, begin, middle), balance(op, operands, middle, end));
+}
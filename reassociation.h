@@ -0,0 +1,55 @@
+#ifndef REASSOCIATION_H
+#define REASSOCIATION_H
+
+#include <map>
+#include <vector>
+#include "compiler.h"
+#include "expression_tree.h"
+
+// Fast-math pass that shortens dependency chains. Chains of + and - and
+// chains of * are rebuilt as balanced trees, and polynomials written with ^
+// in a single leaf are rewritten into Horner form (degree 3 or less) or
+// Estrin form. Results can differ in rounding from the original order.
+class Reassociator {
+public:
+    explicit Reassociator(const Compiler& compiler);
+    
+    // Returns the tokens unchanged when they do not form a valid tree
+    std::vector<Token> run(const std::vector<Token>& tokens);
+    
+private:
+    struct Term {
+        ExprPtr node;
+        bool negative;
+    };
+    
+    // By operation, so operators defined under other names match too
+    bool isOperator(const ExprPtr& node, Operation operation) const;
+    
+    ExprPtr rewrite(const ExprPtr& node);
+    void countUses(const ExprPtr& node);
+    void collectTerms(const ExprPtr& node, bool negative, std::vector<Term>& terms);
+    void collectFactors(const ExprPtr& node, std::vector<ExprPtr>& factors);
+    
+    // Sums the terms as a balanced tree, extracting a polynomial if there is one
+    ExprPtr sum(std::vector<Term>& terms);
+    
+    // Removes the polynomial terms from terms and returns them rebuilt, or null
+    ExprPtr extractPolynomial(std::vector<Term>& terms);
+    ExprPtr findVariable(const std::vector<Term>& terms) const;
+    bool matchPower(const ExprPtr& node, const ExprPtr& variable, int& degree) const;
+    bool matchTerm(const ExprPtr& node, const ExprPtr& variable, ExprPtr& coefficient, int& degree) const;
+    
+    // Coefficients are indexed by degree; null means zero
+    static ExprPtr horner(const std::vector<ExprPtr>& coefficients, const ExprPtr& x);
+    static ExprPtr estrin(const std::vector<ExprPtr>& coefficients, size_t begin, size_t end, const ExprPtr& x);
+    static ExprPtr power(const ExprPtr& x, size_t exponent);
+    static ExprPtr multiply(const ExprPtr& a, const ExprPtr& b);
+    static ExprPtr balance(const std::string& op, const std::vector<ExprPtr>& operands, size_t begin, size_t end);
+    
+    const Compiler& compiler;
+    std::map<const ExprNode*, int> uses;
+    std::map<const ExprNode*, ExprPtr> rewritten;
+};
+
+#endif // REASSOCIATION_H
@@ -0,0 +1,321 @@
+#include "simplifier.h"
+#include <cctype>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+// Rewriting stops after this many passes even if rules still match
+const int MAX_PASSES = 64;
+
+struct RuleText {
+    const char* pattern;
+    const char* replacement;
+    bool exact;
+};
+
+// Letters match any subexpression; a letter used twice only matches equal
+// subexpressions. The first matching rule wins.
+const RuleText RULES[] = {
+    {"a 1 *", "a", true},
+    {"1 a *", "a", true},
+    {"a 1 /", "a", true},
+    {"a 0 -", "a", true},
+    // Integer exponents use repeated squaring, so these are exact too
+    {"a 1 ^", "a", true},
+    {"a 0 ^", "1", true},
+    {"a 2 ^", "a dup *", true},
+    {"a abs abs", "a abs", true},
+    {"a a min", "a", true},
+    {"a a max", "a", true},
+    {"a a b select", "a", true},
+    // -0 + 0 is +0
+    {"a 0 +", "a", false},
+    {"0 a +", "a", false},
+    // Wrong for NaN and infinities
+    {"a 0 *", "0", false},
+    {"0 a *", "0", false},
+    {"a a -", "0", false},
+    // Only for a nonzero constant a, like every rule that removes a division
+    {"a a /", "1", false},
+    // Rounding, and NaN for negative a
+    {"a sqrt dup *", "a", false},
+    // Overflow and underflow of the square
+    {"a dup * sqrt", "a abs", false},
+    // The power routine rounds differently and gives 0 for a <= 0
+    {"a 0.5 ^", "a sqrt", false},
+};
+
+void collectLetters(const ExprPtr& node, std::vector<std::string>& letters) {
+    if (node->token.type == Token::VARIABLE) {
+        letters.push_back(node->token.strValue);
+    }
+    for (const ExprPtr& operand : node->operands) {
+        collectLetters(operand, letters);
+    }
+}
+
+} // namespace
+
+Simplifier::Simplifier(const Compiler& compiler) : compiler(compiler) {
+    for (const RuleText& text : RULES) {
+        Rule rule;
+        rule.text = std::string(text.pattern) + " -> " + text.replacement;
+        rule.pattern = parse(text.pattern);
+        rule.replacement = parse(text.replacement);
+        rule.exact = text.exact;
+        
+        std::vector<std::string> kept;
+        collectLetters(rule.replacement, kept);
+        std::vector<std::string> letters;
+        collectLetters(rule.pattern, letters);
+        for (const std::string& letter : letters) {
+            bool found = false;
+            for (const std::string& name : kept) {
+                found = found || name == letter;
+            }
+            if (!found) {
+                rule.dropped.push_back(letter);
+            }
+        }
+        collectDivisors(rule.pattern, rule.divisors);
+        rules.push_back(rule);
+    }
+}
+
+ExprPtr Simplifier::parse(const std::string& rpn) const {
+    // Letters become VARIABLE tokens so ExpressionTree can build the pattern
+    std::vector<Token> tokens;
+    std::istringstream words(rpn);
+    std::string word;
+    while (words >> word) {
+        auto op = compiler.operators.find(word);
+        if (op != compiler.operators.end()) {
+            tokens.push_back(Token(op->second.type, word));
+        } else if (std::isdigit(static_cast<unsigned char>(word[0]))) {
+            tokens.push_back(Token(Token::NUMBER, word));
+        } else {
+            tokens.push_back(Token(Token::VARIABLE, word));
+        }
+    }
+    
+    ExpressionTree tree;
+    if (!tree.build(tokens, compiler) || tree.roots.size() != 1) {
+        throw std::runtime_error("Invalid simplifier rule: " + rpn);
+    }
+    return tree.roots.front();
+}
+
+std::vector<Token> Simplifier::run(const std::vector<Token>& tokens) {
+    counts.clear();
+    
+    // Checked before the shuffles go, so stack underflow is still reported
+    ExpressionTree tree;
+    if (!tree.build(tokens, compiler)) {
+        return tokens;
+    }
+    
+    // Stack shuffles that cancel out never reach the tree as nodes, but
+    // would be emitted again for an unchanged expression
+    std::map<std::string, int> shuffles;
+    std::vector<Token> reduced;
+    for (const Token& token : tokens) {
+        if (compiler.operation(token) == OP_SWAP && !reduced.empty()) {
+            if (compiler.operation(reduced.back()) == OP_SWAP) {
+                reduced.pop_back();
+                shuffles["swap swap ->"]++;
+                continue;
+            }
+            if (compiler.operation(reduced.back()) == OP_DUP) {
+                shuffles["dup swap -> dup"]++;
+                continue;
+            }
+        }
+        reduced.push_back(token);
+    }
+    
+    // A rewrite can expose another, so repeat until a pass changes nothing
+    bool rewrote = false;
+    for (int pass = 0; pass < MAX_PASSES; pass++) {
+        changed = false;
+        rewritten.clear();
+        for (ExprPtr& root : tree.roots) {
+            root = rewrite(root);
+        }
+        if (!changed) {
+            break;
+        }
+        rewrote = true;
+    }
+    
+    // Unchanged expressions keep their remaining stack operations, and so
+    // do expressions whose flattened form would be longer, such as a shared
+    // value emitted again for each use
+    if (rewrote && !tree.repeatsWork()) {
+        std::vector<Token> flat = tree.flatten();
+        if (flat.size() <= reduced.size()) {
+            counts.insert(shuffles.begin(), shuffles.end());
+            return flat;
+        }
+    }
+    counts = shuffles;
+    return reduced;
+}
+
+ExprPtr Simplifier::rewrite(const ExprPtr& node) {
+    auto done = rewritten.find(node.get());
+    if (done != rewritten.end()) {
+        return done->second;
+    }
+    if (node->operands.empty()) {
+        return node;
+    }
+    
+    ExprPtr result = node;
+    std::vector<ExprPtr> operands;
+    for (const ExprPtr& operand : node->operands) {
+        operands.push_back(rewrite(operand));
+    }
+    if (operands != node->operands) {
+        result = std::make_shared<ExprNode>(node->token);
+        result->operands = operands;
+    }
+    
+    for (const Rule& rule : rules) {
+        if (!rule.exact && !compiler.options.fastMath) {
+            continue;
+        }
+        
+        Bindings bindings;
+        if (!match(rule.pattern, result, bindings)) {
+            continue;
+        }
+        // Removing a division would also remove its division by zero error,
+        // so the rule's own divisions need divisors known to be nonzero
+        bool raises = false;
+        for (const std::string& letter : rule.dropped) {
+            raises = raises || canRaise(bindings.at(letter));
+        }
+        for (const ExprPtr& divisor : rule.divisors) {
+            raises = raises || !isNonzero(instantiate(divisor, bindings));
+        }
+        if (raises) {
+            continue;
+        }
+        
+        result = instantiate(rule.replacement, bindings);
+        counts[rule.text]++;
+        changed = true;
+        break;
+    }
+    
+    rewritten[node.get()] = result;
+    return result;
+}
+
+bool Simplifier::match(const ExprPtr& pattern, const ExprPtr& node, Bindings& bindings) const {
+    const Token& token = pattern->token;
+    if (token.type == Token::VARIABLE) {
+        auto bound = bindings.find(token.strValue);
+        if (bound == bindings.end()) {
+            bindings[token.strValue] = node;
+            return true;
+        }
+        return equal(bound->second, node);
+    }
+    if (token.type == Token::NUMBER) {
+        // a 0 - is exact but a -0 - is not
+        return node->token.type == Token::NUMBER &&
+               std::memcmp(&node->token.numValue, &token.numValue, sizeof(double)) == 0;
+    }
+    
+    if (compiler.operation(node->token) != compiler.operation(token) ||
+        node->operands.size() != pattern->operands.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < pattern->operands.size(); i++) {
+        if (!match(pattern->operands[i], node->operands[i], bindings)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+ExprPtr Simplifier::instantiate(const ExprPtr& replacement, const Bindings& bindings) {
+    if (replacement->token.type == Token::VARIABLE) {
+        return bindings.at(replacement->token.strValue);
+    }
+    
+    ExprPtr node = std::make_shared<ExprNode>(replacement->token);
+    for (const ExprPtr& operand : replacement->operands) {
+        node->operands.push_back(instantiate(operand, bindings));
+    }
+    return node;
+}
+
+bool Simplifier::equal(const ExprPtr& a, const ExprPtr& b) const {
+    if (a == b) {
+        return true;
+    }
+    if (a->operands.size() != b->operands.size()) {
+        return false;
+    }
+    if (!a->operands.empty()) {
+        if (compiler.operation(a->token) != compiler.operation(b->token)) {
+            return false;
+        }
+    } else if (a->token.type != b->token.type) {
+        return false;
+    } else if (a->token.type == Token::NUMBER) {
+        // By bit pattern, so 0 and -0 stay apart
+        if (std::memcmp(&a->token.numValue, &b->token.numValue, sizeof(double)) != 0) {
+            return false;
+        }
+    } else if (a->token.strValue != b->token.strValue) {
+        return false;
+    }
+    
+    for (size_t i = 0; i < a->operands.size(); i++) {
+        if (!equal(a->operands[i], b->operands[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Simplifier::collectDivisors(const ExprPtr& pattern, std::vector<ExprPtr>& divisors) const {
+    Operation operation = compiler.operation(pattern->token);
+    if (operation == OP_DIV || operation == OP_MOD) {
+        divisors.push_back(pattern->operands[1]);
+    }
+    for (const ExprPtr& operand : pattern->operands) {
+        collectDivisors(operand, divisors);
+    }
+}
+
+bool Simplifier::isNonzero(const ExprPtr& node) const {
+    // A NaN divisor raises too
+    double value;
+    if (node->token.type == Token::NUMBER) {
+        value = node->token.numValue;
+    } else if (node->token.type == Token::CONSTANT) {
+        value = compiler.constants.at(node->token.strValue);
+    } else {
+        return false;
+    }
+    return value < 0.0 || value > 0.0;
+}
+
+bool Simplifier::canRaise(const ExprPtr& node) const {
+    Operation operation = compiler.operation(node->token);
+    if (operation == OP_DIV || operation == OP_MOD) {
+        return true;
+    }
+    for (const ExprPtr& operand : node->operands) {
+        if (canRaise(operand)) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,57 @@
+#ifndef SIMPLIFIER_H
+#define SIMPLIFIER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "compiler.h"
+#include "expression_tree.h"
+
+// Algebraic simplification driven by the rule table in simplifier.cpp.
+// Rules are written in RPN and applied bottom-up until none matches. Exact
+// rules give the same bits for every input, including NaN, infinities and
+// -0, so they are always used; the others only with -ffast-math. No rule
+// removes a subexpression that can raise a division by zero.
+class Simplifier {
+public:
+    explicit Simplifier(const Compiler& compiler);
+    
+    // Returns the tokens unchanged when they do not form a valid tree
+    std::vector<Token> run(const std::vector<Token>& tokens);
+    
+    // How often each rule fired in the last run, by rule text
+    const std::map<std::string, int>& fired() const { return counts; }
+    
+private:
+    struct Rule {
+        std::string text;
+        ExprPtr pattern;
+        ExprPtr replacement;
+        bool exact;
+        // Pattern letters that do not appear in the replacement
+        std::vector<std::string> dropped;
+        // Divisors of the pattern's own / and %, which the rule removes
+        std::vector<ExprPtr> divisors;
+    };
+    
+    typedef std::map<std::string, ExprPtr> Bindings;
+    
+    ExprPtr parse(const std::string& rpn) const;
+    ExprPtr rewrite(const ExprPtr& node);
+    
+    // Operators match by operation, so names added by defineOperator do too
+    bool match(const ExprPtr& pattern, const ExprPtr& node, Bindings& bindings) const;
+    static ExprPtr instantiate(const ExprPtr& replacement, const Bindings& bindings);
+    bool equal(const ExprPtr& a, const ExprPtr& b) const;
+    bool canRaise(const ExprPtr& node) const;
+    bool isNonzero(const ExprPtr& node) const;
+    void collectDivisors(const ExprPtr& pattern, std::vector<ExprPtr>& divisors) const;
+    
+    const Compiler& compiler;
+    std::vector<Rule> rules;
+    std::map<const ExprNode*, ExprPtr> rewritten;
+    std::map<std::string, int> counts;
+    bool changed = false;
+};
+
+#endif // SIMPLIFIER_H